@@ -0,0 +1,99 @@
+#ifndef CLASS_BENCHMARK
+#define CLASS_BENCHMARK
+
+#include <nctl/Array.h>
+#include <nctl/StaticString.h>
+
+#include "SceneContext.h"
+
+/// In-application benchmark class
+/*! It renders the built-in scenes multiple times with different settings, one render per frame update,
+ *  and compares their throughput. The current world is replaced and the original settings are restored at the end. */
+class Benchmark
+{
+  public:
+	/// The setting that changes between runs
+	enum class Type
+	{
+		TILE_ORDER,
+		/// Tile sizes from 4 to 32 pixels, rendering in thread local tile buffers or directly in the frame
+		TILE_SIZE,
+		/// The multi-threaded backends: `std::thread` and `nc::Thread` pools and the nCine job system
+		BACKEND,
+		/// From one thread to one per processor, with the configured backend, to show contention between them
+		THREAD_SCALING,
+		/// Point lights added to the built-in scenes, to show how the shading cost grows with the number of lights
+		LIGHT_SCALING,
+		/// The error of global trace and path trace against a global trace render with many times the samples, at the same time budget
+		/*! Only the Cornell box is rendered: lit by its emissive rectangle alone, the two tracers converge to the same image */
+		EQUAL_TIME
+	};
+
+	struct Configuration
+	{
+		Type type = Type::TILE_ORDER;
+		/// Every combination is rendered this number of times and only the fastest render is kept
+		int numRepetitions = 3;
+	};
+
+	struct Result
+	{
+		nctl::StaticString<64> name;
+		float seconds = 0.0f;
+		/// Millions of pixel samples per second
+		float megaSamplesPerSecond = 0.0f;
+		/// Throughput relative to the first setting rendering the same scene
+		float speedup = 0.0f;
+		/// Root mean square error against the reference render, negative if not measured
+		float rmse = -1.0f;
+	};
+
+	explicit Benchmark(SceneContext &sc);
+	~Benchmark();
+
+	inline const Configuration &config() const { return config_; }
+	inline Configuration &config() { return config_; }
+
+	void start();
+	void cancel();
+	/// Starts the next render if the current one has completed
+	void update();
+
+	inline bool isRunning() const { return isRunning_; }
+	float progress() const;
+	inline const nctl::Array<Result> &results() const { return results_; }
+
+  private:
+	static const unsigned int NumScenes = 2;
+
+	Configuration config_;
+	SceneContext &sc_;
+	SceneContext::Configuration savedConfig_;
+
+	bool isRunning_;
+	/// The identifier of the current render and the last event received for it
+	unsigned int renderId_;
+	SceneContext::RenderEvent::Type renderState_;
+	int renderSamples_;
+	float renderRmse_;
+	/// The samples per pixel of the last built-in scene, before the equal time runs change them
+	unsigned int sceneSamples_;
+	/// The tracer type of the last built-in scene, before the runs change it
+	pm::Tracer::Type sceneTracerType_;
+	unsigned int runIndex_;
+	unsigned int numRuns_;
+	nctl::Array<Result> results_;
+
+	static void onRenderEvent(const SceneContext::RenderEvent &event, void *userData);
+
+	unsigned int firstScene() const;
+	unsigned int numScenes() const;
+	unsigned int numVariants() const;
+	void prepareEqualTimeScene();
+	void startRun();
+	void completeRun();
+	void completeEqualTimeRun(Result &result, float seconds);
+	void finish();
+};
+
+#endif
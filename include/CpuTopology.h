@@ -0,0 +1,41 @@
+#ifndef CLASS_CPUTOPOLOGY
+#define CLASS_CPUTOPOLOGY
+
+#include <nctl/Array.h>
+
+/// Processor topology class
+/*! On Linux it reads cores, packages and NUMA nodes from sysfs, elsewhere every logical CPU is considered a core of a single node */
+class CpuTopology
+{
+  public:
+	struct Cpu
+	{
+		int index = 0;
+		int core = 0;
+		int package = 0;
+		int node = 0;
+		/// Zero for the first logical CPU of a physical core, then one for its first SMT sibling and so on
+		int siblingRank = 0;
+	};
+
+	explicit CpuTopology(unsigned int numCpus);
+
+	inline unsigned int numCpus() const { return cpus_.size(); }
+	inline unsigned int numCores() const { return numCores_; }
+	inline unsigned int numNodes() const { return numNodes_; }
+	inline const Cpu &cpu(unsigned int index) const { return cpus_[index]; }
+
+	/// Fills the array with CPU indices, every physical core comes before any of the SMT siblings
+	void physicalFirstOrder(nctl::Array<int> &order) const;
+	/// Fills the array with CPU indices taken in turn from every NUMA node, physical cores first
+	void nodeRoundRobinOrder(nctl::Array<int> &order) const;
+
+  private:
+	nctl::Array<Cpu> cpus_;
+	unsigned int numCores_;
+	unsigned int numNodes_;
+
+	void readTopology();
+};
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef CLASS_SCENE_CONTEXT
 #define CLASS_SCENE_CONTEXT
 
+#include <memory>
 #include <nctl/UniquePtr.h>
 #include <ncine/TimeStamp.h>
 
@@ -17,19 +18,44 @@ namespace nc = ncine;
 class SceneContext
 {
   public:
+	/// The scenes that can be created without loading a file
+	enum class BuiltinScene
+	{
+		SPHERES,
+		CORNELL_BOX
+	};
+
 	struct Configuration
 	{
 		// Immediately applied configuration
 		bool copyTexture = true;
+		/// Only the tiles committed since the last copy are tonemapped to the texture
+		bool copyDirtyTiles = true;
+		/// Tints every pixel according to the samples it has accumulated
+		bool showSampleCounts = false;
+		/// Seconds per frame of the user interface, rendering threads back off when it is missed, zero to disable
+		float frameTimeTarget = 0.0f;
 
 		// Tracing configuration
-#if STD_THREADS
-		int maxThreads = static_cast<int>(std::thread::hardware_concurrency());
-#else
+		ThreadManager::Backend backend = ThreadManager::Backend::NC_THREAD;
 		int maxThreads = static_cast<int>(nc::Thread::numProcessors());
-#endif
 		int numThreads = maxThreads - 1;
 		int tileSize = 16;
+		ThreadManager::Scheduler scheduler = ThreadManager::Scheduler::WORK_STEALING;
+		ThreadManager::TileOrder tileOrder = ThreadManager::TileOrder::ROW_MAJOR;
+		bool adaptiveTiles = true;
+		ThreadManager::Placement placement = ThreadManager::Placement::PHYSICAL_FIRST;
+		/// Samples per pixel accumulated at every visit of a tile
+		int samplesPerVisit = 1;
+		bool tileBuffers = true;
+		int niceness = 0;
+		bool yieldBetweenTiles = false;
+		/// Seconds per pass, zero to disable
+		float frameBudget = 0.0f;
+		/// Seconds for the whole render, zero to disable
+		float totalBudget = 0.0f;
+		/// Relative error below which tiles stop being sampled, zero to disable
+		float errorThreshold = 0.0f;
 
 		pm::Tracer::Type tracerType = pm::Tracer::Type::PATHTRACE;
 		pm::Camera *camera = nullptr;
@@ -42,23 +68,104 @@ class SceneContext
 		} camInteraction;
 	};
 
+	/// A render event, delivered to the listeners on the main thread
+	struct RenderEvent
+	{
+		enum class Type
+		{
+			/// One or more passes have completed since the last dispatch
+			PASS,
+			COMPLETED,
+			/// The render has been stopped before completing
+			CANCELLED
+		};
+
+		Type type;
+		/// The identifier returned by `startTracing()`
+		unsigned int renderId;
+		/// Samples per pixel accumulated by the completed passes
+		int completedSamples;
+		int numSamples;
+		float progress;
+		/// Seconds since the start of the render
+		float time;
+		/// Root mean square error against the stored reference, negative without one
+		float rmse;
+	};
+
+	/// A function called for every render event, with the data passed when adding the listener
+	typedef void (*RenderCallback)(const RenderEvent &event, void *userData);
+
 	SceneContext()
-	    : tracingTime_(0.0f), frameNumPixels_(0) {}
+	    : tracingTime_(0.0f), renderId_(0), isRenderPending_(false), notifiedSamples_(0), frameNumPixels_(0), frameNumThreads_(0),
+	      framePlacement_(ThreadManager::Placement::LOGICAL), frameBackend_(ThreadManager::Backend::NC_THREAD), fullCopyNeeded_(true), copiedInvGamma_(0.0f),
+	      referenceNumPixels_(0), rmse_(-1.0f) {}
+	/// The threads are joined before the world and the frame they read are destroyed
+	~SceneContext()
+	{
+		threads_.stop();
+		threads_.waitIdle();
+	}
 
 	inline const Configuration &config() const { return config_; }
 	inline Configuration &config() { return config_; }
 
 	void init(int width, int height);
+	/// Replaces the world with one of the built-in scenes
+	void loadBuiltinScene(BuiltinScene scene);
 	void resizeFrame(int width, int height);
-	void startTracing();
+	/// Starts a new render and returns its identifier
+	unsigned int startTracing();
 	void copyToTexture(unsigned char *pixelsPtr);
 
 	void showSampler(pm::Sampler *sampler);
 	void reset();
-	inline void stopTracing() { threads_.stop(); }
+	/// Stops tracing, listeners are notified immediately if the render had not completed
+	void stopTracing();
+	/// Stops tracing and waits for the threads, needed before modifying the world or resizing the frame
+	inline void stopTracingAndWait()
+	{
+		stopTracing();
+		threads_.waitIdle();
+	}
+	/// Blocks until the current render completes, then notifies the listeners
+	void waitTracing();
+
+	/// Listeners should not start or stop a render from the callback, as it runs during the dispatch
+	void addRenderListener(RenderCallback callback, void *userData);
+	void removeRenderListener(RenderCallback callback, void *userData);
+	/// Notifies the listeners about the passes completed since the last call and about the end of the render
+	/*! It only reads counters published by the threads, to be called once per frame from the main thread */
+	void dispatchRenderEvents();
+	/// Returns the identifier of the last started render
+	inline unsigned int renderId() const { return renderId_; }
 	inline bool isTracing() const { return threads_.threadsRunning(); }
 	inline float tracingProgress() const { return threads_.progress(); }
+	/// Returns the seconds needed to complete the last render, or zero if it has not completed yet
+	inline float renderTime() const { return threads_.renderTime(); }
+	inline int numTileUnits() const { return threads_.numTileUnits(); }
+	inline int samplesPerPass() const { return threads_.samplesPerPass(); }
+	inline int numTiles() const { return threads_.numTiles(); }
+	inline int numConvergedTiles() const { return threads_.numConvergedTiles(); }
+	inline unsigned int threadPoolSize() const { return threads_.poolSize(); }
+	inline float restartLatency() const { return threads_.restartLatency(); }
+	inline unsigned int threadsLimit() const { return threads_.threadsLimit(); }
+	/// Applies the configured number of threads to the running render, without restarting it
+	inline void updateNumThreads() { threads_.setNumThreads(static_cast<unsigned int>(config_.numThreads)); }
+	/// Adjusts the number of rendering threads to meet the frame time target, to be called once per frame
+	void throttleThreads(float frameTime);
 	float tracingTime() const;
+
+	/// Stores the frame brought to full brightness as the reference for the error of the next renders
+	/*! A converged render of the same scene makes for a reference that other settings can be compared against */
+	void storeReference();
+	void clearReference();
+	inline bool hasReference() const { return reference_ != nullptr; }
+	/// Returns the root mean square error against the reference at the last render event, negative without one
+	inline float rmse() const { return rmse_; }
+	/// Adds an area light for every emissive rectangle that is not already one, returns the number of added lights
+	/*! The area lighting and global tracers sample area lights at every hit, instead of relying on rays reaching them by chance */
+	unsigned int addEmissiveAreaLights();
 	void savePbm(const char *filename, bool binary);
 	void savePng(const char *filename);
 
@@ -68,14 +175,54 @@ class SceneContext
 	void setCameraType(pm::Camera::Type type);
 
   private:
+	/// The frame memory is allocated uninitialized, to let the pool threads touch it first
+	struct FrameDeleter
+	{
+		inline void operator()(pm::RGBColor *frame) const { ::operator delete(frame); }
+	};
+
+	struct RenderListener
+	{
+		RenderCallback callback;
+		void *userData;
+	};
+
 	Configuration config_;
 	nc::TimeStamp tracingStartTime_;
 	mutable float tracingTime_;
 	ThreadManager threads_;
 
+	unsigned int renderId_;
+	/// Set from the start of a render until its completion or cancellation has been notified
+	bool isRenderPending_;
+	int notifiedSamples_;
+	nctl::Array<RenderListener> renderListeners_;
+
 	pm::World world_;
 	unsigned int frameNumPixels_;
-	nctl::UniquePtr<pm::RGBColor[]> frame_;
+	std::unique_ptr<pm::RGBColor[], FrameDeleter> frame_;
+	/// Number of threads, placement and backend used when the frame memory was touched first
+	int frameNumThreads_;
+	ThreadManager::Placement framePlacement_;
+	ThreadManager::Backend frameBackend_;
+
+	/// Set when the frame changes outside of a render, the next texture copy cannot be limited to the dirty tiles
+	bool fullCopyNeeded_;
+	/// The last time the threads limit has been changed to meet the frame time target
+	nc::TimeStamp lastThrottleTime_;
+	float copiedInvGamma_;
+	nctl::Array<ThreadManager::DirtyTile> dirtyTiles_;
+
+	nctl::UniquePtr<pm::RGBColor[]> reference_;
+	unsigned int referenceNumPixels_;
+	float rmse_;
+
+	void placeFrame(int width, int height);
+	void notifyRenderEvent(RenderEvent::Type type);
+	float computeRmse();
+	void tonemapFrame(unsigned char *pixelsPtr);
+	void overlaySampleCounts(unsigned char *pixelsPtr);
+	void tonemapRegion(unsigned char *pixelsPtr, int x, int y, int width, int height);
 };
 
 #endif
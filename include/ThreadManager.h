@@ -1,15 +1,20 @@
 #ifndef CLASS_THREADMANAGER
 #define CLASS_THREADMANAGER
 
-#define STD_THREADS (0)
-#if STD_THREADS
-	#include <vector>
-	#include <thread>
-#else
-	#include <nctl/Array.h>
-	#include <ncine/Thread.h>
-	namespace nc = ncine;
-#endif
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <nctl/Array.h>
+#include <nctl/UniquePtr.h>
+#include <ncine/Thread.h>
+#include <ncine/TimeStamp.h>
+#include <ncine/IJobSystem.h>
+
+namespace nc = ncine;
 
 namespace pm {
 	class World;
@@ -19,64 +24,422 @@ namespace pm {
 }
 
 /// Threads management class
+/*! Threads are created once and kept parked between renders, so that a restart only needs to wake them up.
+ *  Every render has its own generation number: stopping a render does not wait for the threads, which
+ *  discard the tiles they are still working on. */
 class ThreadManager
 {
   public:
+	/// How a render is executed
+	enum class Backend
+	{
+		/// The whole frame is rendered at once by the calling thread, that is blocked until completion
+		SINGLE,
+		/// Tiles are rendered one after the other by the calling thread, that is blocked until completion
+		TILED_SINGLE,
+		/// Tiles are rendered by a pool of `std::thread` threads
+		STD_THREAD,
+		/// Tiles are rendered by a pool of `nc::Thread` threads
+		NC_THREAD,
+		/// Tiles are rendered by jobs of the nCine job system, shared with the rest of the application
+		JOB_SYSTEM
+	};
+
+	/// How tiles of a sample pass are distributed among threads
+	enum class Scheduler
+	{
+		/// Every thread renders a fixed interleaved subset of the tiles, moving to the next pass without waiting for the others
+		/*! Units and samples per pass cannot change between passes, adaptive tiles, budgets and the error threshold are ignored */
+		STATIC_INTERLEAVE,
+		/// Threads pick the next tile from a shared atomic cursor
+		SHARED_CURSOR,
+		/// Every thread owns a range of tiles and steals from the others when it runs out
+		WORK_STEALING
+	};
+
+	/// The order in which the tiles of a sample pass are visited
+	enum class TileOrder
+	{
+		/// Row after row, from the first pixel of the frame
+		ROW_MAJOR,
+		/// Z-order curve, interleaving the bits of the tile column and row
+		MORTON,
+		/// Hilbert curve, consecutive tiles are always adjacent
+		HILBERT,
+		/// Rings of tiles around the center of the image, that converges first
+		SPIRAL
+	};
+
+	/// How pool threads are assigned to logical CPUs
+	enum class Placement
+	{
+		/// Thread `i` runs on logical CPU `i`, SMT siblings might be used before other physical cores
+		LOGICAL,
+		/// Every physical core receives a thread before any of the SMT siblings
+		PHYSICAL_FIRST,
+		/// Threads are assigned in turn to every NUMA node, physical cores first
+		NODE_ROUND_ROBIN
+	};
+
 	struct Configuration
 	{
+		/// Changing the backend recreates the pool at the next start
+		Backend backend = Backend::NC_THREAD;
 		unsigned int numThreads = 1;
 		int tileSize = 16;
+		Scheduler scheduler = Scheduler::WORK_STEALING;
+		TileOrder tileOrder = TileOrder::ROW_MAJOR;
+		/// Splits expensive tiles and merges cheap ones based on the cost measured in the previous pass
+		bool adaptiveTiles = true;
+		/// Changing the placement recreates the pool at the next start
+		Placement placement = Placement::PHYSICAL_FIRST;
+		/// Samples per pixel accumulated at every visit of a work unit, while its geometry and frame rows are hot in cache
+		/*! It is the number of samples of the first pass when a frame budget is set */
+		int samplesPerVisit = 1;
+		/// Units are rendered in a thread local buffer and then committed to the frame, otherwise directly in the frame
+		/*! Rendering directly in the frame makes threads share cache lines along tile edges, and a stop has to wait for the units in progress */
+		bool tileBuffers = true;
+		/// Nice value of the pool threads on Linux, higher values lower their priority
+		/*! Without privileges the value of a thread can only grow, lowering it fails with a warning */
+		int niceness = 0;
+		/// Threads yield the processor after every unit, letting other threads of the system run
+		bool yieldBetweenTiles = false;
+		/// Seconds every pass should last, the number of samples per pass is adjusted to fit it, zero to disable
+		float frameBudget = 0.0f;
+		/// Seconds after which the render stops at the end of a pass, zero to disable
+		float totalBudget = 0.0f;
+		/// Tiles stop being sampled when the estimated relative error of all of their pixels is below the threshold, zero to disable
+		/*! The variance of a pixel is estimated from the luminance of its visits, it needs tile buffers.
+		 *  Convergence is decided per tile, so the sampled pixels depend on the tile size. */
+		float errorThreshold = 0.0f;
 		pm::World *world = nullptr;
 		pm::Tracer *tracer = nullptr;
 		pm::Camera *camera = nullptr;
 		pm::RGBColor *frame = nullptr;
 	};
 
+	ThreadManager();
+	~ThreadManager();
+
 	inline const Configuration &config() const { return config_; }
 	inline Configuration &config() { return config_; }
 
+	/// Stops the current render, if any, and starts a new one with the current configuration
+	/*! With a single threaded backend the function returns only when the render has completed */
 	void start();
+	/// Stops the current render without waiting for the threads to complete their tiles
 	void stop();
+	/// Waits until all threads are parked, needed before modifying the world or the frame size
+	void waitIdle();
+	/// Waits until the current render completes, it returns immediately if it has been stopped
+	/*! It should be called from the thread that starts and stops renders, threads only signal the end of the last pass */
+	void wait();
+	/// Clears an uninitialized frame from the pool threads, each one touching first the rows it renders the most
+	void firstTouch(pm::RGBColor *frame, int width, int height);
 	bool threadsRunning() const;
+	/// Changes the number of threads working on the current render, without restarting it
+	/*! Threads above the number sleep after their current unit, new ones join the render and receive a work stealing queue
+	 *  from the next pass. The static interleave scheduler rebinds units to threads once all of them have completed the same
+	 *  number of passes. */
+	void setNumThreads(unsigned int numThreads);
 
 	float progress(unsigned int threadId) const;
 	float progress() const;
+	/// Returns the number of work units in the current pass, tiles can be split or merged between passes
+	int numTileUnits() const;
+	/// Returns the number of samples per pixel rendered in the current pass
+	int samplesPerPass() const;
+	/// Returns the number of samples per pixel accumulated by the completed passes
+	int completedSamples() const;
+	/// Returns the factor that brings the frame to full brightness when only some of the samples have been accumulated
+	float frameScale() const;
+
+	/// Returns the number of threads in the pool, including the parked ones
+	inline unsigned int poolSize() const { return numPoolThreads_; }
+	/// A frame region committed since the last collection
+	struct DirtyTile
+	{
+		int x, y;
+		int width, height;
+	};
+
+	/// Appends the tiles committed since the last call to the array, marking them as clean
+	void collectDirtyTiles(nctl::Array<DirtyTile> &dirtyTiles);
+	/// Read-only view of the samples accumulated by every pixel of the frame
+	/*! Counts are stamped with the generation of the render that wrote them, the ones of previous renders read as zero */
+	class PixelSamples
+	{
+	  public:
+		PixelSamples()
+		    : samples_(nullptr), stamp_(0) {}
+		PixelSamples(const std::atomic<uint64_t> *samples, unsigned int stamp)
+		    : samples_(samples), stamp_(stamp) {}
+
+		inline bool isValid() const { return samples_ != nullptr; }
+		/// Returns the samples of a pixel, zero if the render has not committed it yet
+		inline int operator[](unsigned int index) const
+		{
+			const uint64_t value = samples_[index].load(std::memory_order_relaxed);
+			return (static_cast<unsigned int>(value >> 32) == stamp_) ? static_cast<int>(value & 0xFFFFFFFF) : 0;
+		}
+
+	  private:
+		const std::atomic<uint64_t> *samples_;
+		unsigned int stamp_;
+	};
+
+	/// Returns the samples accumulated by every pixel of the frame, the view is not valid if they are not tracked for a frame of that size
+	/*! Split units, converged tiles and threads running ahead leave pixels of the same frame with different counts.
+	 *  Single threaded backends do not track them, their frame is complete when the render ends. */
+	PixelSamples pixelSamples(int width, int height) const;
+	/// Returns the number of tiles that have stopped being sampled because their error is below the threshold
+	int numConvergedTiles() const;
+	/// Returns the number of tiles of the frame
+	int numTiles() const;
+
+	/// Returns the seconds needed to complete the last render, or zero if it has not completed yet
+	float renderTime() const;
+	/// Returns the seconds between the last restart request and the moment every thread resumed working
+	inline float restartLatency() const { return pool_.restartLatency.load(); }
+
+	/// Returns the maximum number of threads that can render at the same time
+	inline unsigned int threadsLimit() const { return pool_.threadsLimit.load(); }
+	/// Threads above the limit pause between units, it is applied immediately also to the current render
+	/*! The limit is ignored by the static interleave scheduler, as a paused thread would stall the pass */
+	inline void setThreadsLimit(unsigned int limit) { pool_.threadsLimit = (limit > 0) ? limit : 1; }
 
   private:
+	static const unsigned int CacheLineSize = 64;
+
 	struct LocalStorage
 	{
 		int hasFinished = false;
 		float progress = 0.0f;
+		/// The nice value last applied to the thread
+		int niceness = 0;
+
+		/// Tiles are rendered here and then committed to the frame if their render has not been stopped
+		nctl::UniquePtr<pm::RGBColor[]> tileBufferMemory;
+		/// The tile buffer memory aligned to a cache line
+		pm::RGBColor *tileBuffer = nullptr;
+		unsigned int tileBufferSize = 0;
+	};
+
+	/// A range of work unit indices owned by a thread, padded and allocated on a cache line to avoid false sharing
+	struct TileQueue
+	{
+		/// The pass tag is packed in the high 16 bits, followed by the `begin` and the `end` indices in 24 bits each
+		std::atomic<uint64_t> range;
+		char padding[CacheLineSize - sizeof(std::atomic<uint64_t>)];
+	};
+
+	/// A rectangle of pixels rendered by a thread in one go, it can be a tile, a part of it or a group of tiles
+	struct TileUnit
+	{
+		int x, y;
+		int width, height;
+		/// Seconds spent rendering the unit, written by the thread that rendered it
+		float cost;
+		/// Maximum relative error of its pixels after the visit, written by the thread that rendered it
+		float error;
+	};
+
+	enum class JobType
+	{
+		RENDER,
+		FIRST_TOUCH
+	};
+
+	/// The state of a render, shared by all threads to walk through the tiles of every sample pass
+	/*! Threads still working on a stopped render keep a reference to its state, so that they never touch the new one */
+	struct JobState
+	{
+		JobState()
+		    : type(JobType::RENDER), generation(0), pass(0), cursor(0), completedTiles(0), completedUnitSamples(0),
+		      numWorkers(0), passWorkers(0), numQueues(0), queues(nullptr), numInterleavingThreads(0), numCommitting(0),
+		      width(0), height(0), numColumns(0), numRows(0), numTiles(0), numPasses(0), numSamples(0),
+		      samplesPerPass(1), completedSamples(0), maxUnits(0), numConvergedTiles(0), renderTime(0.0f)
+		{
+			numUnits[0] = 0;
+			numUnits[1] = 0;
+		}
+
+		JobType type;
+		Configuration conf;
+		unsigned int generation;
+		std::atomic<int> pass;
+		/// The next unit index and the number of units in the pass, packed like a tile queue range
+		std::atomic<uint64_t> cursor;
+		std::atomic<int> completedTiles;
+		/// Samples rendered by the units of the current pass, it keeps the progress accurate when units render many of them
+		std::atomic<int> completedUnitSamples;
+		/// Number of threads that should work on the render, it can change while the render is running
+		std::atomic<unsigned int> numWorkers;
+		/// Number of workers when the current pass started, used to split its units among threads
+		std::atomic<unsigned int> passWorkers;
+		/// There is a queue for every thread that could join the render
+		unsigned int numQueues;
+		nctl::UniquePtr<char[]> queueMemory;
+		/// The queue memory aligned to a cache line
+		TileQueue *queues;
+		/// Passes completed by every thread with the static interleave scheduler, guarded by the pool mutex
+		nctl::UniquePtr<int[]> threadPasses;
+		/// Threads in the middle of a pass with the static interleave scheduler, guarded by the pool mutex
+		int numInterleavingThreads;
+		/// Number of threads copying a tile to the frame
+		std::atomic<int> numCommitting;
+		int width;
+		int height;
+		int numColumns;
+		int numRows;
+		int numTiles;
+		/// Upper bound to the number of passes, reached earlier when passes render more than one sample
+		int numPasses;
+		int numSamples;
+		/// Samples per pixel of the current pass, chosen when the pass starts
+		std::atomic<int> samplesPerPass;
+		/// Samples per pixel accumulated by all completed passes
+		std::atomic<int> completedSamples;
+		/// Tile indices in visiting order
+		nctl::UniquePtr<int[]> tileOrder;
+
+		/// Work units of even and odd passes, the next pass is planned while the current one is still in use
+		nctl::UniquePtr<TileUnit[]> units[2];
+		std::atomic<int> numUnits[2];
+		int maxUnits;
+		/// Set for every tile committed since the last collection
+		nctl::UniquePtr<std::atomic<int>[]> dirtyTiles;
+		/// Samples accumulated by every pixel in the low 32 bits, stamped with the generation in the high ones
+		/*! The stamp makes the counts of a previous render read as zero, a reused state does not need to clear them */
+		nctl::UniquePtr<std::atomic<uint64_t>[]> pixelSamples;
+		/// Cost of every tile in the last pass, used when planning the next one
+		nctl::UniquePtr<float[]> tileCosts;
+		/// How every tile is rendered in the next pass: as it is, split in parts or merged with others
+		nctl::UniquePtr<int[]> tilePlans;
+		/// Samples per pixel of the tiles that have stopped being sampled, zero for the others
+		nctl::UniquePtr<std::atomic<int>[]> convergedSamples;
+		std::atomic<int> numConvergedTiles;
+		/// Sum of the squared mean luminance of every visit of a pixel, weighted by its samples, only used with an error threshold
+		nctl::UniquePtr<float[]> pixelMoments;
+		/// Maximum relative error of the pixels of every tile in the last pass
+		nctl::UniquePtr<float[]> tileErrors;
+
+		nc::TimeStamp startTime;
+		nc::TimeStamp passStartTime;
+		std::atomic<float> renderTime;
+		/// Time of the stop before the render, the job system batches have no access to the pool one
+		nc::TimeStamp restartTime;
+
+		/// Keeps the state alive while job system jobs reference it, released by the last pass continuation
+		std::shared_ptr<JobState> jobSystemSelf;
+	};
+
+	/// The state used to park threads between renders and to wake them up for a new one
+	struct PoolState
+	{
+		PoolState()
+		    : jobId(0), numActive(0), numParked(0), exit(false), generation(0),
+		      restartRequested(false), numAwake(0), restartLatency(0.0f), numJobSystemRenders(0),
+		      threadsLimit(~0u) {}
+
+		std::mutex mutex;
+		std::condition_variable wakeCondition;
+		std::condition_variable parkCondition;
+		/// Notified when the last pass of a render completes
+		std::condition_variable doneCondition;
+		/// Notified when a pass starts, a render stops or the number of workers changes, threads without units wait on it
+		std::condition_variable passCondition;
+		unsigned int jobId;
+		unsigned int numActive;
+		unsigned int numParked;
+		bool exit;
+		std::shared_ptr<JobState> job;
+
+		/// Incremented every time a render is stopped, threads compare it with the one of their job
+		std::atomic<unsigned int> generation;
+
+		bool restartRequested;
+		nc::TimeStamp restartTime;
+		std::atomic<unsigned int> numAwake;
+		std::atomic<float> restartLatency;
+
+		/// Number of renders, also stopped ones, that still have jobs in the job system
+		std::atomic<int> numJobSystemRenders;
+		/// Threads and job system batches with an index equal or greater than this pause between units
+		std::atomic<unsigned int> threadsLimit;
+	};
+
+	/// The data of every job system job, copied by the job system
+	struct JobSystemData
+	{
+		JobState *job;
+		PoolState *pool;
+		unsigned int batchIndex;
 	};
 
-#if STD_THREADS
-	static void threadFunc(int id, Configuration &conf, LocalStorage &tls);
-#else
 	struct ThreadArg
 	{
 		int id_;
-		const Configuration *conf_;
 		LocalStorage *tls_;
+		PoolState *pool_;
 
 		ThreadArg()
-		    : id_(-1), conf_(nullptr), tls_(nullptr) {}
-		ThreadArg(int id, const Configuration *conf, LocalStorage *tls)
-		    : id_(id), conf_(conf), tls_(tls) {}
+		    : id_(-1), tls_(nullptr), pool_(nullptr) {}
+		ThreadArg(int id, LocalStorage *tls, PoolState *pool)
+		    : id_(id), tls_(tls), pool_(pool) {}
 	};
 
 	static void threadFunc(void *arg);
-#endif
+
+	static void renderOnCallingThread(JobState &job);
+	static void submitJobSystemPass(JobState &job, PoolState &pool);
+	static void jobSystemBatch(nc::JobId, const void *data);
+	static void jobSystemPass(nc::JobId, const void *data);
+	static void renderJob(int id, JobState &job, LocalStorage &tls, PoolState &pool);
+	static void renderInterleavedJob(int id, JobState &job, LocalStorage &tls, int alignmentPixels, PoolState &pool);
+	static int nextInterleavedPass(unsigned int threadId, const JobState &job);
+	static void completeInterleavedPass(JobState &job, PoolState &pool);
+	static void rebindInterleavedThreads(JobState &job);
+	static void waitForPass(int pass, const JobState &job, PoolState &pool);
+	static void firstTouchJob(int id, JobState &job);
+	static int prepareTileBuffer(const JobState &job, LocalStorage &tls);
+	static bool processUnit(JobState &job, TileUnit &unit, int numUnitSamples, int unitSamples, LocalStorage &tls, int alignmentPixels, const PoolState &pool);
+	static void renderUnit(JobState &job, const TileUnit &unit, int numSamples, pm::RGBColor *frame);
+	static void markDirtyTiles(JobState &job, const TileUnit &unit);
+	static void storePixelSamples(JobState &job, const TileUnit &unit, int unitSamples);
+	static float updatePixelMoments(JobState &job, const TileUnit &unit, int numUnitSamples, const pm::RGBColor *tileBuffer);
+	static void updateConvergedTiles(JobState &job);
+	static void setTileRegion(const JobState &job, int index, DirtyTile &tile);
+	static int claimTile(int id, int pass, JobState &job);
+	static void fillQueues(JobState &job, int pass, int numUnits);
+	static void fillTileOrder(JobState &job);
+	static int maxTileSplit(int tileSize);
+	static void planTileUnits(JobState &job, int pass);
+	static int nextSamplesPerPass(const JobState &job);
+	static void advancePass(JobState &job, PoolState &pool);
+
+	void preparePool(unsigned int numThreads);
+	void createPool(unsigned int numThreads);
+	void destroyPool();
+	std::shared_ptr<JobState> reuseJob(int width, int height, unsigned int numQueues);
+	void retireJob();
+	void launchJob(const std::shared_ptr<JobState> &job);
 
 	Configuration config_;
+	/// The state of the last started render
+	std::shared_ptr<JobState> job_;
+	/// States of stopped renders, kept to reuse their arrays
+	nctl::Array<std::shared_ptr<JobState>> retiredJobs_;
+	PoolState pool_;
+	unsigned int numPoolThreads_;
+	Placement poolPlacement_;
+	Backend poolBackend_;
 
-#if STD_THREADS
-	std::vector<std::thread> threads_;
-	std::vector<LocalStorage> tls_;
-#else
-	nctl::Array<nc::Thread> threads_;
+	/// Only the array of the pool backend has threads
+	std::vector<std::thread> stdThreads_;
+	nctl::Array<nc::Thread> ncThreads_;
 	nctl::Array<ThreadArg> args_;
 	nctl::Array<LocalStorage> tls_;
-#endif
 };
 
 #endif
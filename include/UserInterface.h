@@ -5,6 +5,7 @@
 
 class VisualFeedback;
 class SceneContext;
+class Benchmark;
 
 namespace pm {
 
@@ -20,7 +21,7 @@ class Material;
 class UserInterface
 {
   public:
-	UserInterface(VisualFeedback &vf, SceneContext &sc);
+	UserInterface(VisualFeedback &vf, SceneContext &sc, Benchmark &bm);
 
 	void createGuiMainWindow();
 	void cameraInteraction();
@@ -32,6 +33,7 @@ class UserInterface
 	nctl::String filename_;
 	VisualFeedback &vf_;
 	SceneContext &sc_;
+	Benchmark &bm_;
 
 	void createSamplerGuiTree(pm::Sampler *sampler);
 	bool createLightGuiTree(pm::Light *light);
@@ -14,6 +14,7 @@ class AppConfiguration;
 class VisualFeedback;
 class UserInterface;
 class SceneContext;
+class Benchmark;
 
 namespace nc = ncine;
 
@@ -34,6 +35,7 @@ class MyEventHandler :
 	nctl::UniquePtr<VisualFeedback> vf_;
 	nctl::UniquePtr<UserInterface> ui_;
 	nctl::UniquePtr<SceneContext> sc_;
+	nctl::UniquePtr<Benchmark> bm_;
 };
 
 #endif
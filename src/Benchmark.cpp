@@ -0,0 +1,352 @@
+#include <cmath>
+
+#include "Benchmark.h"
+#include "PointLight.h"
+#include "Ambient.h"
+
+namespace {
+
+const char *sceneNames[] = { "Spheres", "Cornell Box" };
+const char *tileOrderNames[] = { "Row Major", "Morton", "Hilbert", "Spiral" };
+const int tileSizes[] = { 4, 8, 16, 32 };
+const unsigned int NumTileSizes = sizeof(tileSizes) / sizeof(*tileSizes);
+const ThreadManager::Backend backends[] = { ThreadManager::Backend::STD_THREAD, ThreadManager::Backend::NC_THREAD, ThreadManager::Backend::JOB_SYSTEM };
+const char *backendNames[] = { "std::thread", "nc::Thread", "Job System" };
+const int lightCounts[] = { 0, 8, 32, 128 };
+/// The first variant renders the reference, the others estimate the same light transport in a fraction of its time
+const pm::Tracer::Type equalTimeTracers[] = { pm::Tracer::Type::GLOBALTRACE, pm::Tracer::Type::GLOBALTRACE, pm::Tracer::Type::PATHTRACE };
+const char *equalTimeNames[] = { "Reference", "GlobalTrace", "PathTrace" };
+/// The reference has this many times the samples of the scene, the other runs have the time of the scene samples
+const unsigned int ReferenceSamplesFactor = 16;
+
+/// A horizontal rectangle above the objects of a built-in scene, in its own units
+struct LightGrid
+{
+	float x, y, z;
+	float width, depth;
+};
+/// Above the spheres, and just below the ceiling of the Cornell box
+const LightGrid lightGrids[] = { { -3.0f, 4.0f, -3.0f, 6.0f, 4.0f }, { 28.0f, 540.0f, 28.0f, 500.0f, 503.0f } };
+
+/// Spreads point lights on a grid above the scene, their total radiance does not depend on their number
+void addPointLights(pm::World &world, const LightGrid &grid, int numLights)
+{
+	const int gridSize = static_cast<int>(ceilf(sqrtf(static_cast<float>(numLights))));
+	for (int i = 0; i < numLights; i++)
+	{
+		const float x = grid.x + grid.width * ((i % gridSize) + 0.5f) / gridSize;
+		const float z = grid.z + grid.depth * ((i / gridSize) + 0.5f) / gridSize;
+		auto light = world.createLight<pm::PointLight>(x, grid.y, z);
+		light->setRadianceScale(0.1f / numLights);
+	}
+}
+
+/// Resizing generates new sample sets, the sampler is set again so the view plane state follows the new size
+void resizeViewPlaneSampler(pm::World &world, unsigned int numSamples)
+{
+	pm::Sampler *sampler = world.viewPlane().sampler();
+	sampler->resize(numSamples);
+	world.viewPlane().setSampler(sampler);
+}
+
+}
+
+///////////////////////////////////////////////////////////
+// CONSTRUCTORS and DESTRUCTOR
+///////////////////////////////////////////////////////////
+
+Benchmark::Benchmark(SceneContext &sc)
+    : sc_(sc), isRunning_(false), renderId_(0), renderState_(SceneContext::RenderEvent::Type::PASS), renderSamples_(0), renderRmse_(-1.0f),
+      sceneSamples_(0), sceneTracerType_(pm::Tracer::Type::PATHTRACE), runIndex_(0), numRuns_(0)
+{
+	sc_.addRenderListener(onRenderEvent, this);
+}
+
+Benchmark::~Benchmark()
+{
+	sc_.removeRenderListener(onRenderEvent, this);
+}
+
+///////////////////////////////////////////////////////////
+// PUBLIC FUNCTIONS
+///////////////////////////////////////////////////////////
+
+void Benchmark::start()
+{
+	if (isRunning_)
+		return;
+
+	savedConfig_ = sc_.config();
+	if (config_.numRepetitions < 1)
+		config_.numRepetitions = 1;
+
+	results_.clear();
+	for (unsigned int i = firstScene(); i < NumScenes; i++)
+	{
+		for (unsigned int j = 0; j < numVariants(); j++)
+		{
+			results_.emplaceBack();
+			switch (config_.type)
+			{
+				case Type::TILE_ORDER:
+					results_.back().name.format("%s - %s", sceneNames[i], tileOrderNames[j]);
+					break;
+				case Type::TILE_SIZE:
+					results_.back().name.format("%s - %dpx %s", sceneNames[i], tileSizes[j % NumTileSizes], (j < NumTileSizes) ? "Tile Buffers" : "Direct");
+					break;
+				case Type::BACKEND:
+					results_.back().name.format("%s - %s", sceneNames[i], backendNames[j]);
+					break;
+				case Type::THREAD_SCALING:
+					results_.back().name.format("%s - %u %s", sceneNames[i], j + 1, (j == 0) ? "thread" : "threads");
+					break;
+				case Type::LIGHT_SCALING:
+					results_.back().name.format("%s - %d more lights", sceneNames[i], lightCounts[j]);
+					break;
+				case Type::EQUAL_TIME:
+					results_.back().name.format("%s - %s", sceneNames[i], equalTimeNames[j]);
+					break;
+			}
+		}
+	}
+
+	runIndex_ = 0;
+	numRuns_ = numScenes() * numVariants() * config_.numRepetitions;
+	isRunning_ = true;
+	LOGI_X("Benchmark started with %u renders", numRuns_);
+
+	startRun();
+}
+
+void Benchmark::cancel()
+{
+	if (isRunning_ == false)
+		return;
+
+	sc_.stopTracing();
+	LOGI("Benchmark cancelled");
+	finish();
+}
+
+void Benchmark::update()
+{
+	if (isRunning_ == false || renderState_ == SceneContext::RenderEvent::Type::PASS)
+		return;
+
+	// A render stopped from the user interface has no meaningful time
+	if (renderState_ == SceneContext::RenderEvent::Type::CANCELLED)
+	{
+		cancel();
+		return;
+	}
+
+	completeRun();
+	// The reference takes many times the other runs and is rendered only once
+	const unsigned int numRepetitions = static_cast<unsigned int>(config_.numRepetitions);
+	if (config_.type == Type::EQUAL_TIME && (runIndex_ / numRepetitions) % numVariants() == 0)
+		runIndex_ = (runIndex_ / numRepetitions + 1) * numRepetitions;
+	else
+		runIndex_++;
+	if (runIndex_ < numRuns_)
+		startRun();
+	else
+	{
+		LOGI("Benchmark results:");
+		for (unsigned int i = 0; i < results_.size(); i++)
+		{
+			const Result &firstResult = results_[(i / numVariants()) * numVariants()];
+			if (firstResult.megaSamplesPerSecond > 0.0f)
+				results_[i].speedup = results_[i].megaSamplesPerSecond / firstResult.megaSamplesPerSecond;
+			if (results_[i].rmse >= 0.0f)
+				LOGI_X("%s: %.3fs, %.2f Msamples/s, x%.2f, RMSE %.5f", results_[i].name.data(), results_[i].seconds, results_[i].megaSamplesPerSecond, results_[i].speedup, results_[i].rmse);
+			else
+				LOGI_X("%s: %.3fs, %.2f Msamples/s, x%.2f", results_[i].name.data(), results_[i].seconds, results_[i].megaSamplesPerSecond, results_[i].speedup);
+		}
+		finish();
+	}
+}
+
+float Benchmark::progress() const
+{
+	if (isRunning_ == false || numRuns_ == 0)
+		return 0.0f;
+
+	return (runIndex_ + sc_.tracingProgress()) / static_cast<float>(numRuns_);
+}
+
+///////////////////////////////////////////////////////////
+// PRIVATE FUNCTIONS
+///////////////////////////////////////////////////////////
+
+void Benchmark::onRenderEvent(const SceneContext::RenderEvent &event, void *userData)
+{
+	Benchmark *benchmark = static_cast<Benchmark *>(userData);
+	if (benchmark->isRunning_ && event.renderId == benchmark->renderId_)
+	{
+		benchmark->renderState_ = event.type;
+		benchmark->renderSamples_ = event.completedSamples;
+		benchmark->renderRmse_ = event.rmse;
+	}
+}
+
+/*! Only the Cornell box is lit by emissive geometry alone, as the equal time runs need */
+unsigned int Benchmark::firstScene() const
+{
+	return (config_.type == Type::EQUAL_TIME) ? static_cast<unsigned int>(SceneContext::BuiltinScene::CORNELL_BOX) : 0;
+}
+
+unsigned int Benchmark::numScenes() const
+{
+	return NumScenes - firstScene();
+}
+
+unsigned int Benchmark::numVariants() const
+{
+	switch (config_.type)
+	{
+		case Type::TILE_ORDER:
+			return sizeof(tileOrderNames) / sizeof(*tileOrderNames);
+		case Type::TILE_SIZE:
+			return 2 * NumTileSizes;
+		case Type::BACKEND:
+			return sizeof(backends) / sizeof(*backends);
+		case Type::THREAD_SCALING:
+			return static_cast<unsigned int>(savedConfig_.maxThreads);
+		case Type::LIGHT_SCALING:
+			return sizeof(lightCounts) / sizeof(*lightCounts);
+		case Type::EQUAL_TIME:
+			return sizeof(equalTimeTracers) / sizeof(*equalTimeTracers);
+	}
+	return 0;
+}
+
+void Benchmark::startRun()
+{
+	const unsigned int numRepetitions = static_cast<unsigned int>(config_.numRepetitions);
+	const unsigned int repetition = runIndex_ % numRepetitions;
+	const unsigned int variant = (runIndex_ / numRepetitions) % numVariants();
+	const unsigned int sceneIndex = runIndex_ / (numRepetitions * numVariants());
+	const unsigned int scene = firstScene() + sceneIndex;
+
+	// Every number of lights starts again from the original scene
+	if (repetition == 0 && (variant == 0 || config_.type == Type::LIGHT_SCALING))
+	{
+		sc_.loadBuiltinScene(static_cast<SceneContext::BuiltinScene>(scene));
+		sceneTracerType_ = sc_.config().tracerType;
+		sceneSamples_ = sc_.world().viewPlane().samplerState().numSamples();
+		if (config_.type == Type::LIGHT_SCALING)
+			addPointLights(sc_.world(), lightGrids[scene], lightCounts[variant]);
+		else if (config_.type == Type::EQUAL_TIME)
+			prepareEqualTimeScene();
+	}
+
+	switch (config_.type)
+	{
+		case Type::TILE_ORDER:
+			sc_.config().tileOrder = static_cast<ThreadManager::TileOrder>(variant);
+			break;
+		case Type::TILE_SIZE:
+			sc_.config().tileSize = tileSizes[variant % NumTileSizes];
+			sc_.config().tileBuffers = (variant < NumTileSizes);
+			// Tiles have to keep their size to be compared
+			sc_.config().adaptiveTiles = false;
+			break;
+		case Type::BACKEND:
+			sc_.config().backend = backends[variant];
+			break;
+		case Type::THREAD_SCALING:
+			sc_.config().numThreads = static_cast<int>(variant) + 1;
+			break;
+		case Type::LIGHT_SCALING:
+		case Type::EQUAL_TIME:
+			break;
+	}
+	// Throughput is only comparable between complete renders
+	sc_.config().frameBudget = 0.0f;
+	sc_.config().totalBudget = 0.0f;
+	sc_.config().errorThreshold = 0.0f;
+	if (config_.type == Type::EQUAL_TIME)
+	{
+		sc_.config().tracerType = equalTimeTracers[variant];
+		if (variant > 0)
+		{
+			const Result &reference = results_[sceneIndex * numVariants()];
+			sc_.config().totalBudget = reference.seconds / ReferenceSamplesFactor;
+		}
+	}
+
+	sc_.stopTracingAndWait();
+	// Every run can take all the samples of the reference, the budgeted ones stop when their time is over,
+	// and each of them draws new sample sets, uncorrelated to the ones of the reference
+	if (config_.type == Type::EQUAL_TIME)
+		resizeViewPlaneSampler(sc_.world(), sceneSamples_ * ReferenceSamplesFactor);
+	sc_.reset();
+	renderState_ = SceneContext::RenderEvent::Type::PASS;
+	renderId_ = sc_.startTracing();
+}
+
+void Benchmark::completeRun()
+{
+	Result &result = results_[runIndex_ / config_.numRepetitions];
+	const float seconds = sc_.renderTime();
+	if (config_.type == Type::EQUAL_TIME)
+	{
+		completeEqualTimeRun(result, seconds);
+		return;
+	}
+	if (seconds <= 0.0f || (result.seconds > 0.0f && result.seconds <= seconds))
+		return;
+
+	const pm::ViewPlane &viewPlane = sc_.world().viewPlane();
+	const float numPixelSamples = static_cast<float>(viewPlane.width() * viewPlane.height()) * viewPlane.samplerState().numSamples();
+	result.seconds = seconds;
+	result.megaSamplesPerSecond = numPixelSamples / (seconds * 1000000.0f);
+}
+
+/*! The budgeted renders keep their lowest error */
+void Benchmark::completeEqualTimeRun(Result &result, float seconds)
+{
+	const unsigned int variant = (runIndex_ / config_.numRepetitions) % numVariants();
+	if (seconds <= 0.0f || renderSamples_ <= 0)
+		return;
+
+	if (variant == 0)
+		sc_.storeReference();
+	else if (result.rmse >= 0.0f && result.rmse <= renderRmse_)
+		return;
+
+	const pm::ViewPlane &viewPlane = sc_.world().viewPlane();
+	const float numPixelSamples = static_cast<float>(viewPlane.width() * viewPlane.height()) * renderSamples_;
+	result.seconds = seconds;
+	result.megaSamplesPerSecond = numPixelSamples / (seconds * 1000000.0f);
+	result.rmse = (variant == 0) ? 0.0f : renderRmse_;
+}
+
+/*! The camera and the tracer type are those of the last built-in scene, the rest of the configuration is restored */
+void Benchmark::finish()
+{
+	SceneContext::Configuration &scConf = sc_.config();
+	pm::Camera *camera = scConf.camera;
+
+	scConf = savedConfig_;
+	scConf.camera = camera;
+	scConf.tracerType = sceneTracerType_;
+	// A reference of a built-in scene has nothing to do with the world the user loads next
+	if (config_.type == Type::EQUAL_TIME)
+	{
+		sc_.clearReference();
+		sc_.stopTracingAndWait();
+		resizeViewPlaneSampler(sc_.world(), sceneSamples_);
+	}
+	isRunning_ = false;
+}
+
+/*! Global trace gathers direct light from the area lights, path trace from the emissive geometry its rays hit.
+ *  The rectangle needs an area light and the ambient term, which only global trace adds, is turned off. */
+void Benchmark::prepareEqualTimeScene()
+{
+	sc_.addEmissiveAreaLights();
+	auto ambient = std::make_unique<pm::Ambient>();
+	ambient->setRadianceScale(0.0f);
+	sc_.world().setAmbientLight(std::move(ambient));
+}
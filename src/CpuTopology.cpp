@@ -0,0 +1,156 @@
+#include <cstdio>
+#include <algorithm>
+
+#include "CpuTopology.h"
+
+namespace {
+
+bool readInteger(const char *path, int &value)
+{
+	FILE *file = fopen(path, "r");
+	if (file == nullptr)
+		return false;
+
+	const bool hasRead = (fscanf(file, "%d", &value) == 1);
+	fclose(file);
+	return hasRead;
+}
+
+/// Parses a sysfs CPU list like "0-7,16-23" and assigns the node to the listed CPUs
+void readNodeCpuList(const char *path, int node, nctl::Array<CpuTopology::Cpu> &cpus)
+{
+	FILE *file = fopen(path, "r");
+	if (file == nullptr)
+		return;
+
+	int first = 0;
+	while (fscanf(file, "%d", &first) == 1)
+	{
+		int last = first;
+		int separator = fgetc(file);
+		if (separator == '-')
+		{
+			if (fscanf(file, "%d", &last) != 1)
+				break;
+			separator = fgetc(file);
+		}
+
+		for (int i = first; i <= last; i++)
+		{
+			if (i >= 0 && static_cast<unsigned int>(i) < cpus.size())
+				cpus[i].node = node;
+		}
+
+		if (separator != ',')
+			break;
+	}
+	fclose(file);
+}
+
+}
+
+///////////////////////////////////////////////////////////
+// CONSTRUCTORS and DESTRUCTOR
+///////////////////////////////////////////////////////////
+
+CpuTopology::CpuTopology(unsigned int numCpus)
+    : numCores_(numCpus), numNodes_(1)
+{
+	cpus_.setCapacity(numCpus);
+	for (unsigned int i = 0; i < numCpus; i++)
+	{
+		Cpu &cpu = cpus_.emplaceBack();
+		cpu.index = static_cast<int>(i);
+		cpu.core = static_cast<int>(i);
+	}
+
+#if defined(__linux__) && !defined(__ANDROID__)
+	readTopology();
+#endif
+}
+
+///////////////////////////////////////////////////////////
+// PUBLIC FUNCTIONS
+///////////////////////////////////////////////////////////
+
+void CpuTopology::physicalFirstOrder(nctl::Array<int> &order) const
+{
+	nctl::Array<Cpu> sortedCpus = cpus_;
+	std::stable_sort(sortedCpus.data(), sortedCpus.data() + sortedCpus.size(), [](const Cpu &a, const Cpu &b) {
+		if (a.siblingRank != b.siblingRank)
+			return a.siblingRank < b.siblingRank;
+		return a.index < b.index;
+	});
+
+	order.clear();
+	for (unsigned int i = 0; i < sortedCpus.size(); i++)
+		order.pushBack(sortedCpus[i].index);
+}
+
+void CpuTopology::nodeRoundRobinOrder(nctl::Array<int> &order) const
+{
+	nctl::Array<int> physicalOrder;
+	physicalFirstOrder(physicalOrder);
+
+	// Every node list keeps the physical first order
+	nctl::Array<nctl::Array<int>> nodeCpus;
+	for (unsigned int i = 0; i < numNodes_; i++)
+		nodeCpus.emplaceBack();
+	for (unsigned int i = 0; i < physicalOrder.size(); i++)
+		nodeCpus[cpus_[physicalOrder[i]].node].pushBack(physicalOrder[i]);
+
+	order.clear();
+	for (unsigned int i = 0; order.size() < cpus_.size(); i++)
+	{
+		for (unsigned int node = 0; node < numNodes_; node++)
+		{
+			if (i < nodeCpus[node].size())
+				order.pushBack(nodeCpus[node][i]);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////
+// PRIVATE FUNCTIONS
+///////////////////////////////////////////////////////////
+
+void CpuTopology::readTopology()
+{
+	char path[128];
+	for (unsigned int i = 0; i < cpus_.size(); i++)
+	{
+		Cpu &cpu = cpus_[i];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/core_id", i);
+		readInteger(path, cpu.core);
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", i);
+		readInteger(path, cpu.package);
+	}
+
+	// Logical CPUs sharing the same core of the same package are SMT siblings
+	numCores_ = 0;
+	for (unsigned int i = 0; i < cpus_.size(); i++)
+	{
+		cpus_[i].siblingRank = 0;
+		for (unsigned int j = 0; j < i; j++)
+		{
+			if (cpus_[j].core == cpus_[i].core && cpus_[j].package == cpus_[i].package)
+				cpus_[i].siblingRank++;
+		}
+		if (cpus_[i].siblingRank == 0)
+			numCores_++;
+	}
+
+	int maxNode = 0;
+	for (int node = 0; node < 64; node++)
+	{
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE *file = fopen(path, "r");
+		if (file == nullptr)
+			continue;
+		fclose(file);
+
+		readNodeCpuList(path, node, cpus_);
+		maxNode = node;
+	}
+	numNodes_ = static_cast<unsigned int>(maxNode + 1);
+}
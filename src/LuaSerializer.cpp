@@ -1,5 +1,6 @@
 #include "LuaSerializer.h"
 #include <nctl/String.h>
+#include <nctl/Array.h>
 #include <cstring>
 #include <ncine/IFile.h>
 #include <ncine/LuaStateManager.h>
@@ -59,6 +60,21 @@ int samplerIndex(const pm::World &world, const pm::Sampler *sampler)
 	return index;
 }
 
+/// A sampler as defined in a scene file, identical deterministic definitions share the same sampler
+struct SamplerDefinition
+{
+	pm::Sampler::Type type;
+	unsigned int numSamples;
+	/// Index of the sampler in the world
+	unsigned int index;
+};
+
+/// Only these samplers generate the same sample sets from the same definition, the random ones have to stay uncorrelated
+bool isDeterministic(pm::Sampler::Type type)
+{
+	return (type == pm::Sampler::Type::REGULAR || type == pm::Sampler::Type::HAMMERSLEY || type == pm::Sampler::Type::HALTON);
+}
+
 int materialIndex(const pm::World &world, const pm::Material *material)
 {
 	ASSERT(material);
@@ -332,6 +348,9 @@ bool LuaSerializer::load(const char *filename, pm::World &world)
 	// Samplers loader
 	nc::LuaUtils::retrieveFieldTable(L, -1, Names::samplers);
 	const unsigned int numSamplers = nc::LuaUtils::rawLen(L, -1);
+	// Samplers are read-only while rendering, the sample sets of identical deterministic definitions are generated only once
+	nctl::Array<SamplerDefinition> samplerDefinitions(numSamplers);
+	nctl::Array<unsigned int> samplerIndices(numSamplers);
 
 	for (unsigned int i = 0; i < numSamplers; i++)
 	{
@@ -341,6 +360,32 @@ bool LuaSerializer::load(const char *filename, pm::World &world)
 		const unsigned int numSamples = nc::LuaUtils::retrieveField<uint32_t>(L, -1, Names::numSamples);
 
 		const pm::Sampler::Type type = samplerStringToType(typeString);
+		int sharedIndex = -1;
+		if (isDeterministic(type))
+		{
+			for (unsigned int j = 0; j < samplerDefinitions.size(); j++)
+			{
+				if (samplerDefinitions[j].type == type && samplerDefinitions[j].numSamples == numSamples)
+				{
+					sharedIndex = static_cast<int>(samplerDefinitions[j].index);
+					break;
+				}
+			}
+		}
+
+		if (sharedIndex >= 0)
+		{
+			samplerIndices.pushBack(static_cast<unsigned int>(sharedIndex));
+			nc::LuaUtils::pop(L);
+			continue;
+		}
+
+		SamplerDefinition &definition = samplerDefinitions.emplaceBack();
+		definition.type = type;
+		definition.numSamples = numSamples;
+		definition.index = static_cast<unsigned int>(world.samplers().size());
+		samplerIndices.pushBack(definition.index);
+
 		std::unique_ptr<pm::Sampler> sampler;
 		switch (type)
 		{
@@ -382,7 +427,7 @@ bool LuaSerializer::load(const char *filename, pm::World &world)
 	world.viewPlane().setGamma(gamma);
 	world.viewPlane().editMaxDepth() = nc::LuaUtils::retrieveField<int32_t>(L, -1, Names::maxDepth);
 	const unsigned int samplerIndex = nc::LuaUtils::retrieveField<uint32_t>(L, -1, Names::samplerIndex);
-	world.viewPlane().setSampler(world.samplers()[samplerIndex].get());
+	world.viewPlane().setSampler(world.samplers()[samplerIndices[samplerIndex]].get());
 
 	nc::LuaUtils::pop(L);
 
@@ -406,12 +451,12 @@ bool LuaSerializer::load(const char *filename, pm::World &world)
 				matte->ambient().editKd() = nc::LuaUtils::retrieveField<float>(L, -1, Names::ambientKd);
 				matte->ambient().editCd() = retrieveLuaColorFieldTable(L, -1, Names::ambientCd);
 				const unsigned int ambientSamplerIndex = nc::LuaUtils::retrieveField<uint32_t>(L, -1, Names::ambientSamplerIndex);
-				matte->ambient().setSampler(world.samplers()[ambientSamplerIndex].get());
+				matte->ambient().setSampler(world.samplers()[samplerIndices[ambientSamplerIndex]].get());
 
 				matte->diffuse().editKd() = nc::LuaUtils::retrieveField<float>(L, -1, Names::diffuseKd);
 				matte->diffuse().editCd() = retrieveLuaColorFieldTable(L, -1, Names::diffuseCd);
 				const unsigned int diffuseSamplerIndex = nc::LuaUtils::retrieveField<uint32_t>(L, -1, Names::diffuseSamplerIndex);
-				matte->diffuse().setSampler(world.samplers()[diffuseSamplerIndex].get());
+				matte->diffuse().setSampler(world.samplers()[samplerIndices[diffuseSamplerIndex]].get());
 
 				world.addMaterial(std::move(matte));
 				break;
@@ -423,18 +468,18 @@ bool LuaSerializer::load(const char *filename, pm::World &world)
 				phong->ambient().editKd() = nc::LuaUtils::retrieveField<float>(L, -1, Names::ambientKd);
 				phong->ambient().editCd() = retrieveLuaColorFieldTable(L, -1, Names::ambientCd);
 				const unsigned int ambientSamplerIndex = nc::LuaUtils::retrieveField<uint32_t>(L, -1, Names::ambientSamplerIndex);
-				phong->ambient().setSampler(world.samplers()[ambientSamplerIndex].get());
+				phong->ambient().setSampler(world.samplers()[samplerIndices[ambientSamplerIndex]].get());
 
 				phong->diffuse().editKd() = nc::LuaUtils::retrieveField<float>(L, -1, Names::diffuseKd);
 				phong->diffuse().editCd() = retrieveLuaColorFieldTable(L, -1, Names::diffuseCd);
 				const unsigned int diffuseSamplerIndex = nc::LuaUtils::retrieveField<uint32_t>(L, -1, Names::diffuseSamplerIndex);
-				phong->diffuse().setSampler(world.samplers()[diffuseSamplerIndex].get());
+				phong->diffuse().setSampler(world.samplers()[samplerIndices[diffuseSamplerIndex]].get());
 
 				phong->specular().editKs() = nc::LuaUtils::retrieveField<float>(L, -1, Names::specularKs);
 				phong->specular().editCs() = retrieveLuaColorFieldTable(L, -1, Names::specularCs);
 				phong->specular().editExp() = nc::LuaUtils::retrieveField<float>(L, -1, Names::specularExp);
 				const unsigned int specularSamplerIndex = nc::LuaUtils::retrieveField<uint32_t>(L, -1, Names::specularSamplerIndex);
-				phong->specular().setSampler(world.samplers()[specularSamplerIndex].get());
+				phong->specular().setSampler(world.samplers()[samplerIndices[specularSamplerIndex]].get());
 
 				world.addMaterial(std::move(phong));
 				break;
@@ -572,8 +617,8 @@ bool LuaSerializer::load(const char *filename, pm::World &world)
 				ambientOccluder->editRadianceScale() = nc::LuaUtils::retrieveField<float>(L, -1, Names::radianceScale);
 				ambientOccluder->editColor() = retrieveLuaColorFieldTable(L, -1, Names::color);
 				ambientOccluder->editMinAmount() = retrieveLuaColorFieldTable(L, -1, Names::minAmount);
-				const unsigned int samplerIndex = nc::LuaUtils::retrieveField<uint32_t>(L, -1, Names::diffuseSamplerIndex);
-				ambientOccluder->setSampler(world.samplers()[samplerIndex].get());
+				const unsigned int samplerIndex = nc::LuaUtils::retrieveField<uint32_t>(L, -1, Names::samplerIndex);
+				ambientOccluder->setSampler(world.samplers()[samplerIndices[samplerIndex]].get());
 
 				world.addLight(std::move(ambientOccluder));
 				break;
@@ -596,6 +641,10 @@ bool LuaSerializer::load(const char *filename, pm::World &world)
 				pm::Emissive *emissive = static_cast<pm::Emissive *>(material);
 				std::unique_ptr<pm::EnvironmentLight> environmentLight = std::make_unique<pm::EnvironmentLight>(emissive);
 				environmentLight->editCastShadows() = castShadows;
+				// Scenes saved before the sampler was serialized leave the light to its default one
+				uint32_t samplerIndex = 0;
+				if (nc::LuaUtils::tryRetrieveField<uint32_t>(L, -1, Names::samplerIndex, samplerIndex))
+					environmentLight->setSampler(world.samplers()[samplerIndices[samplerIndex]].get());
 
 				world.addLight(std::move(environmentLight));
 				break;
@@ -831,6 +880,8 @@ void LuaSerializer::save(const char *filename, const pm::World &world)
 			{
 				const pm::EnvironmentLight *environmentLight = static_cast<const pm::EnvironmentLight *>(light);
 				indent(file, amount).formatAppend("%s = %d,\n", Names::materialIndex, materialIndex(world, &environmentLight->material()));
+				if (environmentLight->sampler())
+					indent(file, amount).formatAppend("%s = %d,\n", Names::samplerIndex, samplerIndex(world, environmentLight->sampler()));
 				break;
 			}
 		}
@@ -1,14 +1,34 @@
 #include <fstream>
+#include <cstring>
+#include <cmath>
 
 #include "SceneContext.h"
 #include "ObjectsPool.h"
+#include "Rectangle.h"
+#include "AreaLight.h"
+#include "Hammersley.h"
 
 #include <ncine/TextureSaverPng.h>
 
-void initWorld(pm::World &world, pm::PinHole &camera, pm::Tracer::Type &tracerType);
+void initWorld(pm::World &world, pm::PinHole &camera, pm::Tracer::Type &tracerType, SceneContext::BuiltinScene scene);
 
-// 0 - single thread, 1 - tiled single thread, 2 - tiled multi-thread
-#define THREADING_TYPE (2)
+namespace {
+
+/// Seconds between two changes of the threads limit
+const float ThrottleInterval = 0.1f;
+
+/// Brings a pixel with only some of the samples accumulated to full brightness
+inline float pixelScale(const ThreadManager::PixelSamples &pixelSamples, unsigned int index, int numSamples, float frameScale)
+{
+	if (pixelSamples.isValid() == false)
+		return frameScale;
+
+	// Pixels without samples are still black
+	const int samples = pixelSamples[index];
+	return (samples > 0) ? numSamples / static_cast<float>(samples) : frameScale;
+}
+
+}
 
 ///////////////////////////////////////////////////////////
 // PUBLIC FUNCTIONS
@@ -21,10 +41,21 @@ void SceneContext::init(int width, int height)
 	resizeFrame(width, height);
 
 	LOGI("Setting up the scene...");
+	loadBuiltinScene(BuiltinScene::CORNELL_BOX);
+}
+
+void SceneContext::loadBuiltinScene(BuiltinScene scene)
+{
+	stopTracingAndWait();
+	world_.clear();
+	// The stored reference is a render of the replaced world
+	clearReference();
+
 	config_.camera = objectsPool().retrieveCamera(pm::Camera::Type::PINHOLE);
 	pm::PinHole *camera = static_cast<pm::PinHole *>(config_.camera);
 
-	initWorld(world_, *camera, config_.tracerType);
+	initWorld(world_, *camera, config_.tracerType, scene);
+	reset();
 }
 
 void SceneContext::resizeFrame(int width, int height)
@@ -35,64 +66,160 @@ void SceneContext::resizeFrame(int width, int height)
 	if (static_cast<unsigned int>(width * height) != frameNumPixels_)
 	{
 		frameNumPixels_ = width * height;
-		frame_ = nctl::makeUnique<pm::RGBColor[]>(frameNumPixels_);
+		placeFrame(width, height);
 	}
+	// The tile grid changes with the frame dimensions
+	fullCopyNeeded_ = true;
 }
 
-void SceneContext::startTracing()
+unsigned int SceneContext::startTracing()
 {
+	// A pending render is going to be replaced by the new one
+	dispatchRenderEvents();
+	if (isRenderPending_)
+	{
+		isRenderPending_ = false;
+		notifyRenderEvent(RenderEvent::Type::CANCELLED);
+	}
+
 	LOGI("Rendering started");
 	tracingStartTime_ = nc::TimeStamp::now();
 
-	pm::Tracer *tracer = objectsPool().retrieveTracer(config_.tracerType);
-#if THREADING_TYPE == 0
-	LOGI(" with one thread...");
-	config_.camera->renderScene(world_, *tracer, frame_.get());
-#elif THREADING_TYPE == 1
-	LOGI(" with one thread (tiled)...");
-	for (int i = 0; i < world_.viewPlane().height(); i += config_.tileSize)
-		for (int j = 0; j < world_.viewPlane().width(); j += config_.tileSize)
-			config_.camera->renderScene(world_, *tracer, frame_.get(), j, i, config_.tileSize);
-#elif THREADING_TYPE == 2
-	LOGI_X(" with %u threads...", config_.numThreads);
+	switch (config_.backend)
+	{
+		case ThreadManager::Backend::SINGLE:
+			LOGI(" with one thread...");
+			break;
+		case ThreadManager::Backend::TILED_SINGLE:
+			LOGI(" with one thread (tiled)...");
+			break;
+		case ThreadManager::Backend::STD_THREAD:
+			LOGI_X(" with %u std::thread threads...", config_.numThreads);
+			break;
+		case ThreadManager::Backend::NC_THREAD:
+			LOGI_X(" with %u nc::Thread threads...", config_.numThreads);
+			break;
+		case ThreadManager::Backend::JOB_SYSTEM:
+			LOGI_X(" with %u job system jobs per pass...", config_.numThreads);
+			break;
+	}
+
+	// The frame is always reset before tracing, its content can be discarded
+	if (config_.numThreads != frameNumThreads_ || config_.placement != framePlacement_ || config_.backend != frameBackend_)
+		placeFrame(world_.viewPlane().width(), world_.viewPlane().height());
 
 	ThreadManager::Configuration &threadsConfig = threads_.config();
+	threadsConfig.backend = config_.backend;
 	threadsConfig.numThreads = config_.numThreads;
 	threadsConfig.tileSize = config_.tileSize;
+	threadsConfig.scheduler = config_.scheduler;
+	threadsConfig.tileOrder = config_.tileOrder;
+	threadsConfig.adaptiveTiles = config_.adaptiveTiles;
+	threadsConfig.placement = config_.placement;
+	threadsConfig.samplesPerVisit = config_.samplesPerVisit;
+	threadsConfig.tileBuffers = config_.tileBuffers;
+	threadsConfig.niceness = config_.niceness;
+	threadsConfig.yieldBetweenTiles = config_.yieldBetweenTiles;
+	threadsConfig.frameBudget = config_.frameBudget;
+	threadsConfig.totalBudget = config_.totalBudget;
+	threadsConfig.errorThreshold = config_.errorThreshold;
 	threadsConfig.world = &world_;
 	threadsConfig.tracer = objectsPool().retrieveTracer(config_.tracerType);
 	threadsConfig.camera = config_.camera;
 	threadsConfig.frame = frame_.get();
 
 	threads_.start();
-#endif
+	// Single threaded backends return when the render has already completed
+	if (threads_.threadsRunning() == false)
+		tracingTime_ = tracingStartTime_.secondsSince();
+
+	renderId_++;
+	isRenderPending_ = true;
+	notifiedSamples_ = 0;
+	return renderId_;
 }
 
-void SceneContext::copyToTexture(unsigned char *pixelsPtr)
+void SceneContext::stopTracing()
 {
-	const int width = world_.viewPlane().width();
-	const int height = world_.viewPlane().height();
+	// A render that has completed is notified as such, even if the stop comes before the dispatch
+	dispatchRenderEvents();
+	threads_.stop();
+	if (isRenderPending_)
+	{
+		isRenderPending_ = false;
+		notifyRenderEvent(RenderEvent::Type::CANCELLED);
+	}
+}
 
-	const float invGamma = world_.viewPlane().invGamma();
+void SceneContext::waitTracing()
+{
+	threads_.wait();
+	dispatchRenderEvents();
+}
 
-	for (int r = 0; r < height; r++)
+void SceneContext::addRenderListener(RenderCallback callback, void *userData)
+{
+	ASSERT(callback);
+	RenderListener &listener = renderListeners_.emplaceBack();
+	listener.callback = callback;
+	listener.userData = userData;
+}
+
+void SceneContext::removeRenderListener(RenderCallback callback, void *userData)
+{
+	for (unsigned int i = 0; i < renderListeners_.size(); i++)
 	{
-		for (int c = 0; c < width; c++)
+		if (renderListeners_[i].callback == callback && renderListeners_[i].userData == userData)
 		{
-			const unsigned int index = r * width + c;
-			ASSERT(index < frameNumPixels_);
-			const pm::RGBColor &pixel = frame_[index];
+			renderListeners_.removeAt(i);
+			return;
+		}
+	}
+}
 
-			// Tonemapping
-			pm::RGBColor tonemapped = pixel * 16.0f;
-			tonemapped = tonemapped / (pm::RGBColor(1.0f, 1.0f, 1.0f) + tonemapped);
-			tonemapped.pow(invGamma);
+void SceneContext::dispatchRenderEvents()
+{
+	if (isRenderPending_ == false)
+		return;
 
-			pixelsPtr[index * 3 + 0] = static_cast<unsigned char>(tonemapped.r * 255.0f);
-			pixelsPtr[index * 3 + 1] = static_cast<unsigned char>(tonemapped.g * 255.0f);
-			pixelsPtr[index * 3 + 2] = static_cast<unsigned char>(tonemapped.b * 255.0f);
+	// The running state is read first, a render that ends in between is notified at the next call
+	const bool isRunning = threads_.threadsRunning();
+	const int completedSamples = threads_.completedSamples();
+	if (isRunning && completedSamples != notifiedSamples_)
+	{
+		notifiedSamples_ = completedSamples;
+		notifyRenderEvent(RenderEvent::Type::PASS);
+	}
+	else if (isRunning == false)
+	{
+		notifiedSamples_ = completedSamples;
+		isRenderPending_ = false;
+		notifyRenderEvent(RenderEvent::Type::COMPLETED);
+	}
+}
+
+void SceneContext::copyToTexture(unsigned char *pixelsPtr)
+{
+	dirtyTiles_.clear();
+	threads_.collectDirtyTiles(dirtyTiles_);
+
+	const float invGamma = world_.viewPlane().invGamma();
+	if (config_.copyDirtyTiles && fullCopyNeeded_ == false && invGamma == copiedInvGamma_ && config_.showSampleCounts == false)
+	{
+		for (unsigned int i = 0; i < dirtyTiles_.size(); i++)
+		{
+			const ThreadManager::DirtyTile &tile = dirtyTiles_[i];
+			tonemapRegion(pixelsPtr, tile.x, tile.y, tile.width, tile.height);
 		}
+		return;
 	}
+
+	tonemapFrame(pixelsPtr);
+	// The overlay is drawn on a full copy, which is needed again to remove it
+	if (config_.showSampleCounts)
+		overlaySampleCounts(pixelsPtr);
+	fullCopyNeeded_ = config_.showSampleCounts;
+	copiedInvGamma_ = invGamma;
 }
 
 void SceneContext::reset()
@@ -109,6 +236,70 @@ void SceneContext::reset()
 			frame_[index].set(0.0f, 0.0f, 0.0f);
 		}
 	}
+	fullCopyNeeded_ = true;
+}
+
+void SceneContext::storeReference()
+{
+	const int width = world_.viewPlane().width();
+	referenceNumPixels_ = static_cast<unsigned int>(width * world_.viewPlane().height());
+	reference_ = nctl::makeUnique<pm::RGBColor[]>(referenceNumPixels_);
+
+	const int numSamples = world_.viewPlane().samplerState().numSamples();
+	const ThreadManager::PixelSamples pixelSamples = threads_.pixelSamples(width, world_.viewPlane().height());
+	const float frameScale = threads_.frameScale();
+	for (unsigned int i = 0; i < referenceNumPixels_; i++)
+		reference_[i] = frame_[i] * pixelScale(pixelSamples, i, numSamples, frameScale);
+	rmse_ = 0.0f;
+}
+
+void SceneContext::clearReference()
+{
+	reference_.reset(nullptr);
+	referenceNumPixels_ = 0;
+	rmse_ = -1.0f;
+}
+
+unsigned int SceneContext::addEmissiveAreaLights()
+{
+	stopTracingAndWait();
+
+	pm::Sampler *sampler = nullptr;
+	unsigned int numAddedLights = 0;
+	for (auto &object : world_.objects())
+	{
+		pm::Geometry *geometry = object.get();
+		if (geometry->type() != pm::Geometry::Type::RECTANGLE || geometry->material() == nullptr ||
+		    geometry->material()->type() != pm::Material::Type::EMISSIVE)
+			continue;
+
+		bool isAreaLight = false;
+		for (const auto &light : world_.lights())
+		{
+			if (light->type() == pm::Light::Type::AREA && &static_cast<const pm::AreaLight *>(light.get())->object() == geometry)
+			{
+				isAreaLight = true;
+				break;
+			}
+		}
+		if (isAreaLight)
+			continue;
+
+		// Rectangles loaded from a scene file have no sampler to pick the points on their surface, the others keep their own
+		pm::Rectangle *rectangle = static_cast<pm::Rectangle *>(geometry);
+		if (rectangle->sampler() == nullptr)
+		{
+			if (sampler == nullptr)
+				sampler = world_.createSampler<pm::Hammersley>(world_.viewPlane().samplerState().numSamples());
+			rectangle->setSampler(sampler);
+		}
+		rectangle->editCastShadows() = false;
+		world_.createLight<pm::AreaLight>(rectangle);
+		numAddedLights++;
+	}
+
+	LOGI_X("Added %u area lights for emissive rectangles", numAddedLights);
+	return numAddedLights;
 }
 
 void SceneContext::showSampler(pm::Sampler *sampler)
@@ -129,10 +320,9 @@ void SceneContext::showSampler(pm::Sampler *sampler)
 		}
 	}
 
-	static unsigned long jump = 0;
-	static int count = 0;
-	jump = 0;
-	count = 0;
+	// The sampler cursor belongs to the caller, samplers shared by many materials are never modified
+	unsigned long jump = 0;
+	int count = 0;
 	for (unsigned int i = 0; i < sampler->numSamples(); i++)
 	{
 		pm::Vector2 vec = sampler->sampleUnitSquare(jump, count);
@@ -142,6 +332,36 @@ void SceneContext::showSampler(pm::Sampler *sampler)
 		ASSERT(index < frameNumPixels_);
 		frame_[index].set(1.0f, 1.0f, 1.0f);
 	}
+	fullCopyNeeded_ = true;
+}
+
+/*! The limit is halved when a frame misses the target and raised by one thread when frames are well below it (AIMD).
+ *  Changes are spaced in time, so that the effect of the previous one can be measured. */
+void SceneContext::throttleThreads(float frameTime)
+{
+	const unsigned int numThreads = static_cast<unsigned int>(config_.numThreads);
+	unsigned int limit = threads_.threadsLimit();
+	if (limit > numThreads)
+		limit = numThreads;
+
+	if (config_.frameTimeTarget <= 0.0f)
+		limit = numThreads;
+	else if (threads_.threadsRunning() && lastThrottleTime_.secondsSince() > ThrottleInterval)
+	{
+		if (frameTime > config_.frameTimeTarget && limit > 1)
+		{
+			limit /= 2;
+			lastThrottleTime_ = nc::TimeStamp::now();
+		}
+		else if (frameTime < config_.frameTimeTarget * 0.8f && limit < numThreads)
+		{
+			limit++;
+			lastThrottleTime_ = nc::TimeStamp::now();
+		}
+	}
+
+	if (limit != threads_.threadsLimit())
+		threads_.setThreadsLimit(limit);
 }
 
 float SceneContext::tracingTime() const
@@ -159,7 +379,9 @@ void SceneContext::savePbm(const char *filename, bool binary)
 
 	const int width = world_.viewPlane().width();
 	const int height = world_.viewPlane().height();
-	const float invGamma = world_.viewPlane().invGamma();
+
+	nctl::UniquePtr<uint8_t[]> pixels = nctl::makeUnique<uint8_t[]>(width * height * 3);
+	tonemapFrame(pixels.get());
 
 	std::ofstream file;
 	file.open(filename);
@@ -169,24 +391,12 @@ void SceneContext::savePbm(const char *filename, bool binary)
 		for (int j = 0; j < width; j++)
 		{
 			const unsigned int index = static_cast<unsigned int>(i * width + j);
-			ASSERT(index < frameNumPixels_);
-			const pm::RGBColor &pixel = frame_[index];
-
-			// Tonemapping
-			pm::RGBColor tonemapped = pixel * 16.0f;
-			tonemapped = tonemapped / (pm::RGBColor(1.0f, 1.0f, 1.0f) + tonemapped);
-			tonemapped.pow(invGamma);
+			const uint8_t *out = pixels.get() + index * 3;
 
 			if (binary)
-			{
-				const char out[3] = { char(tonemapped.r * 255), char(tonemapped.g * 255), char(tonemapped.b * 255) };
-				file.write(out, sizeof(out));
-			}
+				file.write(reinterpret_cast<const char *>(out), 3);
 			else
-			{
-				const unsigned int out[3] = { unsigned(tonemapped.r * 255), unsigned(tonemapped.g * 255), unsigned(tonemapped.b * 255) };
-				file << out[0] << " " << out[1] << " " << out[2] << " ";
-			}
+				file << unsigned(out[0]) << " " << unsigned(out[1]) << " " << unsigned(out[2]) << " ";
 		}
 		if (binary == false)
 			file << "\n";
@@ -198,29 +408,14 @@ void SceneContext::savePng(const char *filename)
 {
 	const int width = world_.viewPlane().width();
 	const int height = world_.viewPlane().height();
-	const float invGamma = world_.viewPlane().invGamma();
 
+	nctl::UniquePtr<uint8_t[]> pixels = nctl::makeUnique<uint8_t[]>(width * height * 3);
+	tonemapFrame(pixels.get());
+
+	// Vertical flipping
 	nctl::UniquePtr<uint8_t[]> intPixels = nctl::makeUnique<uint8_t[]>(width * height * 3);
 	for (int i = 0; i < height; i++)
-	{
-		for (int j = 0; j < width; j++)
-		{
-			const unsigned int index = static_cast<unsigned int>(i * width + j);
-			ASSERT(index < frameNumPixels_);
-			const pm::RGBColor &pixel = frame_[index];
-
-			// Tonemapping
-			pm::RGBColor tonemapped = pixel * 16.0f;
-			tonemapped = tonemapped / (pm::RGBColor(1.0f, 1.0f, 1.0f) + tonemapped);
-			tonemapped.pow(invGamma);
-
-			// Vertical flipping
-			const unsigned int intIndex = static_cast<unsigned int>((height - i - 1) * width + j);
-			intPixels[intIndex * 3 + 0] = uint8_t(tonemapped.r * 255);
-			intPixels[intIndex * 3 + 1] = uint8_t(tonemapped.g * 255);
-			intPixels[intIndex * 3 + 2] = uint8_t(tonemapped.b * 255);
-		}
-	}
+		memcpy(intPixels.get() + (height - i - 1) * width * 3, pixels.get() + i * width * 3, width * 3);
 
 	nc::TextureSaverPng saver;
 	nc::TextureSaverPng::Properties props;
@@ -243,3 +438,132 @@ void SceneContext::setCameraType(pm::Camera::Type type)
 		config_.camera = newCamera;
 	}
 }
+
+///////////////////////////////////////////////////////////
+// PRIVATE FUNCTIONS
+///////////////////////////////////////////////////////////
+
+/*! The error is computed on the frame brought to full brightness, before tonemapping */
+float SceneContext::computeRmse()
+{
+	const int width = world_.viewPlane().width();
+	const unsigned int numPixels = static_cast<unsigned int>(width * world_.viewPlane().height());
+	if (reference_ == nullptr || referenceNumPixels_ != numPixels)
+		return -1.0f;
+
+	const int numSamples = world_.viewPlane().samplerState().numSamples();
+	const ThreadManager::PixelSamples pixelSamples = threads_.pixelSamples(width, world_.viewPlane().height());
+	const float frameScale = threads_.frameScale();
+	double squaredError = 0.0;
+	for (unsigned int i = 0; i < numPixels; i++)
+	{
+		const float scale = pixelScale(pixelSamples, i, numSamples, frameScale);
+		const pm::RGBColor &pixel = frame_[i];
+		const pm::RGBColor &referencePixel = reference_[i];
+		const float diffR = pixel.r * scale - referencePixel.r;
+		const float diffG = pixel.g * scale - referencePixel.g;
+		const float diffB = pixel.b * scale - referencePixel.b;
+		squaredError += diffR * diffR + diffG * diffG + diffB * diffB;
+	}
+
+	return static_cast<float>(sqrt(squaredError / (3.0 * numPixels)));
+}
+
+void SceneContext::notifyRenderEvent(RenderEvent::Type type)
+{
+	// The error is only measured once per event, the whole frame is read
+	if (reference_ != nullptr && type != RenderEvent::Type::CANCELLED)
+		rmse_ = computeRmse();
+
+	RenderEvent event;
+	event.type = type;
+	event.renderId = renderId_;
+	event.completedSamples = notifiedSamples_;
+	event.numSamples = world_.viewPlane().samplerState().numSamples();
+	event.progress = threads_.progress();
+	event.time = (type == RenderEvent::Type::COMPLETED) ? threads_.renderTime() : tracingStartTime_.secondsSince();
+	event.rmse = rmse_;
+
+	for (unsigned int i = 0; i < renderListeners_.size(); i++)
+		renderListeners_[i].callback(event, renderListeners_[i].userData);
+}
+
+/*! A new frame is allocated and cleared by the pool threads, so that its memory pages end up near the threads rendering them */
+void SceneContext::placeFrame(int width, int height)
+{
+	// The old frame can only be released once no thread is rendering into it
+	threads_.stop();
+	threads_.waitIdle();
+	frame_.reset(static_cast<pm::RGBColor *>(::operator new(frameNumPixels_ * sizeof(pm::RGBColor))));
+	frameNumThreads_ = config_.numThreads;
+	framePlacement_ = config_.placement;
+	frameBackend_ = config_.backend;
+
+	ThreadManager::Configuration &threadsConfig = threads_.config();
+	threadsConfig.backend = config_.backend;
+	threadsConfig.numThreads = config_.numThreads;
+	threadsConfig.placement = config_.placement;
+	threads_.firstTouch(frame_.get(), width, height);
+	fullCopyNeeded_ = true;
+}
+
+void SceneContext::tonemapFrame(unsigned char *pixelsPtr)
+{
+	tonemapRegion(pixelsPtr, 0, 0, world_.viewPlane().width(), world_.viewPlane().height());
+}
+
+/*! Pixels are tinted from blue, with the fewest samples, to red, with all of them */
+void SceneContext::overlaySampleCounts(unsigned char *pixelsPtr)
+{
+	const int width = world_.viewPlane().width();
+	const int height = world_.viewPlane().height();
+	const int numSamples = world_.viewPlane().samplerState().numSamples();
+	const ThreadManager::PixelSamples pixelSamples = threads_.pixelSamples(width, height);
+	if (pixelSamples.isValid() == false)
+		return;
+
+	const unsigned int numPixels = static_cast<unsigned int>(width * height);
+	for (unsigned int i = 0; i < numPixels; i++)
+	{
+		// Pixels without samples yet are left untouched
+		const int samples = pixelSamples[i];
+		if (samples == 0)
+			continue;
+
+		const float ratio = (samples < numSamples) ? samples / static_cast<float>(numSamples) : 1.0f;
+		const unsigned int tint[3] = { static_cast<unsigned int>(ratio * 255.0f), 0, static_cast<unsigned int>((1.0f - ratio) * 255.0f) };
+
+		unsigned char *pixel = pixelsPtr + i * 3;
+		for (unsigned int j = 0; j < 3; j++)
+			pixel[j] = static_cast<unsigned char>((pixel[j] + tint[j]) / 2);
+	}
+}
+
+/*! Every pixel is brought to full brightness according to its own samples */
+void SceneContext::tonemapRegion(unsigned char *pixelsPtr, int x, int y, int width, int height)
+{
+	const int frameWidth = world_.viewPlane().width();
+	const float invGamma = world_.viewPlane().invGamma();
+	const int numSamples = world_.viewPlane().samplerState().numSamples();
+	const ThreadManager::PixelSamples pixelSamples = threads_.pixelSamples(frameWidth, world_.viewPlane().height());
+	const float frameScale = threads_.frameScale();
+
+	for (int r = y; r < y + height; r++)
+	{
+		for (int c = x; c < x + width; c++)
+		{
+			const unsigned int index = r * frameWidth + c;
+			ASSERT(index < frameNumPixels_);
+			const pm::RGBColor &pixel = frame_[index];
+
+			// Tonemapping
+			pm::RGBColor tonemapped = pixel * (16.0f * pixelScale(pixelSamples, index, numSamples, frameScale));
+			tonemapped = tonemapped / (pm::RGBColor(1.0f, 1.0f, 1.0f) + tonemapped);
+			tonemapped.pow(invGamma);
+
+			pixelsPtr[index * 3 + 0] = static_cast<unsigned char>(tonemapped.r * 255.0f);
+			pixelsPtr[index * 3 + 1] = static_cast<unsigned char>(tonemapped.g * 255.0f);
+			pixelsPtr[index * 3 + 2] = static_cast<unsigned char>(tonemapped.b * 255.0f);
+		}
+	}
+}
@@ -1,19 +1,174 @@
 #include "ThreadManager.h"
+#include "CpuTopology.h"
 
-#if !STD_THREADS
-	#include <nctl/String.h>
+#include <nctl/String.h>
+#if defined(__linux__)
+	#include <pthread.h>
+	#include <sys/resource.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
 #endif
+#include <chrono>
+#include <thread>
+#include <new>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 
 #include "World.h"
 #include "Camera.h"
 
 #include <nctl/StaticString.h>
+#include <ncine/ServiceLocator.h>
 #include <ncine/tracy.h>
 
 namespace {
 
-bool stopThreads = false;
+/// Single threaded backends render on the calling thread and do not need a pool
+bool isSingleThreadBackend(ThreadManager::Backend backend)
+{
+	return (backend == ThreadManager::Backend::SINGLE || backend == ThreadManager::Backend::TILED_SINGLE);
+}
+
+/// Pools are created with a thread for every processor, so that a render can grow up to it
+unsigned int poolCapacity(unsigned int numThreads)
+{
+	const unsigned int numProcessors = nc::Thread::numProcessors();
+	return (numThreads > numProcessors) ? numThreads : numProcessors;
+}
+
+/// Single threaded and job system backends do not need a pool
+bool isPoolBackend(ThreadManager::Backend backend)
+{
+	return (backend == ThreadManager::Backend::STD_THREAD || backend == ThreadManager::Backend::NC_THREAD);
+}
+
+/// The visiting order only depends on the tile grid and on how it is split among threads
+bool hasSameTileOrder(const ThreadManager::Configuration &jobConf, const ThreadManager::Configuration &conf)
+{
+	// Jobs of the job system always claim units from the shared cursor
+	const ThreadManager::Scheduler scheduler = (conf.backend == ThreadManager::Backend::JOB_SYSTEM) ? ThreadManager::Scheduler::SHARED_CURSOR : conf.scheduler;
+	return (jobConf.backend == conf.backend && jobConf.tileOrder == conf.tileOrder && jobConf.scheduler == scheduler &&
+	        jobConf.numThreads == conf.numThreads);
+}
+
+/// Maximum number of stopped render states kept to be reused by the next renders
+const unsigned int MaxRetiredJobs = 4;
+
+/// Units are never split below this size in pixels
+const int MinUnitSize = 4;
+/// Maximum number of parts along each side of a split tile
+const int MaxTileSplit = 4;
+
+/// Tile plan of a tile merged with its neighbours
+const int MergedTile = -1;
+/// Tile plan of a merged tile whose unit has already been emitted
+const int EmittedTile = -2;
+
+/// Samples per pixel a tile accumulates before its error estimate is trusted
+const int MinConvergedSamples = 4;
+/// Luminance below which the error of a pixel is considered absolute instead of relative
+const float MinErrorLuminance = 0.001f;
+
+inline float luminance(const pm::RGBColor &color)
+{
+	return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
+}
+
+/// Ranges of unit indices are tagged with the low bits of their pass number, so that a claim cannot cross the boundary of a pass
+const unsigned int RangePassBits = 16;
+const unsigned int RangeIndexBits = 24;
+const uint64_t RangeIndexMask = (1ull << RangeIndexBits) - 1;
+
+inline uint64_t packRange(int pass, uint32_t begin, uint32_t end)
+{
+	const uint64_t passTag = static_cast<uint64_t>(pass) & ((1ull << RangePassBits) - 1);
+	return (passTag << (2 * RangeIndexBits)) | (static_cast<uint64_t>(begin) << RangeIndexBits) | end;
+}
+
+inline int rangePass(uint64_t range)
+{
+	return static_cast<int>(range >> (2 * RangeIndexBits));
+}
+
+inline bool isRangeOfPass(uint64_t range, int pass)
+{
+	return rangePass(range) == (pass & ((1 << RangePassBits) - 1));
+}
+
+inline int rangeBegin(uint64_t range)
+{
+	return static_cast<int>((range >> RangeIndexBits) & RangeIndexMask);
+}
+
+inline int rangeEnd(uint64_t range)
+{
+	return static_cast<int>(range & RangeIndexMask);
+}
+
+/// Interleaves the bits of the two coordinates
+uint32_t mortonCode(uint32_t x, uint32_t y)
+{
+	uint32_t code = 0;
+	for (unsigned int i = 0; i < 16; i++)
+		code |= (((x >> i) & 1) << (2 * i)) | (((y >> i) & 1) << (2 * i + 1));
+	return code;
+}
+
+/// Returns the distance along the Hilbert curve that covers a square with a power of two side
+uint32_t hilbertDistance(uint32_t side, uint32_t x, uint32_t y)
+{
+	uint32_t distance = 0;
+	for (uint32_t s = side / 2; s > 0; s /= 2)
+	{
+		const uint32_t rx = (x & s) > 0 ? 1 : 0;
+		const uint32_t ry = (y & s) > 0 ? 1 : 0;
+		distance += s * s * ((3 * rx) ^ ry);
+
+		// Rotate the quadrant so that the curve stays continuous
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = side - 1 - x;
+				y = side - 1 - y;
+			}
+			const uint32_t t = x;
+			x = y;
+			y = t;
+		}
+	}
+	return distance;
+}
+
+/// Sorts tiles by ring around the image center first, then by angle
+uint32_t spiralKey(int column, int row, int numColumns, int numRows)
+{
+	// Coordinates are doubled to keep the center on a tile corner when the number of tiles is even
+	const int dx = 2 * column + 1 - numColumns;
+	const int dy = 2 * row + 1 - numRows;
+	const uint32_t ring = static_cast<uint32_t>(std::max(std::abs(dx), std::abs(dy)));
+	const float angle = (std::atan2(static_cast<float>(dy), static_cast<float>(dx)) + 3.14159265f) / (2.0f * 3.14159265f);
+	return (ring << 16) | static_cast<uint32_t>(angle * 65535.0f);
+}
+
+}
+
+///////////////////////////////////////////////////////////
+// CONSTRUCTORS and DESTRUCTOR
+///////////////////////////////////////////////////////////
+
+ThreadManager::ThreadManager()
+    : numPoolThreads_(0), poolPlacement_(Placement::LOGICAL), poolBackend_(Backend::NC_THREAD)
+{
+}
 
+ThreadManager::~ThreadManager()
+{
+	stop();
+	// Jobs of the job system might still be referencing the pool state
+	waitIdle();
+	destroyPool();
 }
 
 ///////////////////////////////////////////////////////////
@@ -22,57 +177,289 @@ bool stopThreads = false;
 
 void ThreadManager::start()
 {
+	stop();
+
 	const unsigned int numThreads = config_.numThreads;
+	const unsigned int numQueues = poolCapacity(numThreads);
+	// The arrays of a stopped render are reused when the frame and the tiles have not changed
+	std::shared_ptr<JobState> job;
+	if (isSingleThreadBackend(config_.backend) == false)
+		job = reuseJob(config_.world->viewPlane().width(), config_.world->viewPlane().height(), numQueues);
+	const bool isReused = (job != nullptr);
+	const bool hasTileOrder = isReused && hasSameTileOrder(job->conf, config_);
+	if (isReused == false)
+		job = std::make_shared<JobState>();
 
-	stopThreads = false;
-#if STD_THREADS
-	threads_.reserve(numThreads);
-	tls_.resize(numThreads);
+	job->conf = config_;
+	job->generation = pool_.generation.load();
+	// Jobs are not bound to a thread, they can only claim units from the shared cursor
+	if (config_.backend == Backend::JOB_SYSTEM)
+		job->conf.scheduler = Scheduler::SHARED_CURSOR;
+	// Threads move to their next pass without waiting for the others, the units and the samples of a pass cannot change
+	if (job->conf.scheduler == Scheduler::STATIC_INTERLEAVE)
+	{
+		job->conf.adaptiveTiles = false;
+		job->conf.frameBudget = 0.0f;
+		job->conf.totalBudget = 0.0f;
+		job->conf.errorThreshold = 0.0f;
+	}
 
-	for (unsigned int i = 0; i < numThreads; i++)
-		threads_.emplace_back(threadFunc, i, std::ref(config_), std::ref(tls_[i]));
-#else
-	if (threads_.capacity() < numThreads)
-		threads_.setCapacity(numThreads);
-	if (tls_.capacity() < numThreads)
-		tls_.setCapacity(numThreads);
-	if (args_.capacity() < numThreads)
-		args_.setCapacity(numThreads);
+	job->width = config_.world->viewPlane().width();
+	job->height = config_.world->viewPlane().height();
+	job->numColumns = (job->width + config_.tileSize - 1) / config_.tileSize;
+	job->numRows = (job->height + config_.tileSize - 1) / config_.tileSize;
+	job->numTiles = job->numColumns * job->numRows;
+	job->numSamples = config_.world->viewPlane().samplerState().numSamples();
+	job->numPasses = job->numSamples;
+	job->samplesPerPass = (config_.samplesPerVisit < 1) ? 1 : config_.samplesPerVisit;
+	if (job->samplesPerPass > job->numSamples)
+		job->samplesPerPass = job->numSamples;
 
-	for (unsigned int i = 0; i < numThreads; i++)
+	if (isSingleThreadBackend(config_.backend))
 	{
-		tls_.emplaceBack();
-		args_.emplaceBack(i, &config_, &tls_[i]);
-		threads_.emplaceBack();
-		threads_.back().run(threadFunc, &args_.back());
-	#if !defined(__ANDROID__) && !defined(__EMSCRIPTEN__)
-		threads_.back().setAffinityMask(nc::ThreadAffinityMask(i));
-	#endif
+		job->startTime = nc::TimeStamp::now();
+		retireJob();
+		job_ = job;
+		renderOnCallingThread(*job);
+		return;
 	}
-#endif
+
+	if (isPoolBackend(config_.backend))
+		preparePool(numThreads);
+
+	job->numWorkers = numThreads;
+	job->passWorkers = numThreads;
+	const int numFramePixels = job->width * job->height;
+	if (isReused == false)
+	{
+		job->numQueues = numQueues;
+		// The padding keeps queues on separate cache lines only if the first one starts on a line
+		job->queueMemory = nctl::makeUnique<char[]>(job->numQueues * sizeof(TileQueue) + CacheLineSize - 1);
+		const uintptr_t queueAddress = reinterpret_cast<uintptr_t>(job->queueMemory.get());
+		job->queues = reinterpret_cast<TileQueue *>((queueAddress + CacheLineSize - 1) & ~static_cast<uintptr_t>(CacheLineSize - 1));
+		for (unsigned int i = 0; i < job->numQueues; i++)
+			new (job->queues + i) TileQueue();
+
+		const int maxSplit = maxTileSplit(config_.tileSize);
+		job->maxUnits = job->numTiles * maxSplit * maxSplit;
+		job->units[0] = nctl::makeUnique<TileUnit[]>(job->maxUnits);
+		job->units[1] = nctl::makeUnique<TileUnit[]>(job->maxUnits);
+		job->tileCosts = nctl::makeUnique<float[]>(job->numTiles);
+		job->tilePlans = nctl::makeUnique<int[]>(job->numTiles);
+		job->dirtyTiles = nctl::makeUnique<std::atomic<int>[]>(job->numTiles);
+		job->convergedSamples = nctl::makeUnique<std::atomic<int>[]>(job->numTiles);
+		job->pixelSamples = nctl::makeUnique<std::atomic<uint64_t>[]>(numFramePixels);
+		// Generations start from one, a zero stamp never matches a render
+		for (int i = 0; i < numFramePixels; i++)
+			job->pixelSamples[i].store(0, std::memory_order_relaxed);
+	}
+	fillQueues(*job, 0, job->numTiles);
+
+	if (hasTileOrder == false)
+	{
+		if (job_ && job_->tileOrder && job_->numColumns == job->numColumns && job_->numTiles == job->numTiles && hasSameTileOrder(job_->conf, config_))
+		{
+			if (job->tileOrder == nullptr)
+				job->tileOrder = nctl::makeUnique<int[]>(job->numTiles);
+			memcpy(job->tileOrder.get(), job_->tileOrder.get(), sizeof(int) * job->numTiles);
+		}
+		else
+			fillTileOrder(*job);
+	}
+
+	// No thread references the arrays yet, the launch of the job publishes the stores
+	for (int i = 0; i < job->numTiles; i++)
+	{
+		job->dirtyTiles[i].store(0, std::memory_order_relaxed);
+		job->convergedSamples[i].store(0, std::memory_order_relaxed);
+	}
+	// The luminance of a visit can only be told apart from the accumulated one in a tile buffer
+	if (job->conf.errorThreshold > 0.0f && config_.tileBuffers)
+	{
+		if (job->pixelMoments == nullptr)
+		{
+			job->pixelMoments = nctl::makeUnique<float[]>(numFramePixels);
+			job->tileErrors = nctl::makeUnique<float[]>(job->numTiles);
+		}
+		memset(job->pixelMoments.get(), 0, sizeof(float) * numFramePixels);
+	}
+	else
+	{
+		// The moments also enable the error estimation of every unit
+		job->pixelMoments.reset(nullptr);
+		job->tileErrors.reset(nullptr);
+	}
+	planTileUnits(*job, 0);
+	fillQueues(*job, 0, job->numUnits[0]);
+	if (job->conf.scheduler == Scheduler::STATIC_INTERLEAVE)
+	{
+		// All passes share the units of the first one
+		job->numUnits[1] = job->numUnits[0].load();
+		if (job->threadPasses == nullptr)
+			job->threadPasses = nctl::makeUnique<int[]>(job->numQueues);
+		for (unsigned int i = 0; i < job->numQueues; i++)
+			job->threadPasses[i] = 0;
+	}
+
+	job->startTime = nc::TimeStamp::now();
+	job->passStartTime = job->startTime;
+	retireJob();
+	job_ = job;
+	launchJob(job);
 }
 
 void ThreadManager::stop()
 {
-	stopThreads = true;
-#if STD_THREADS
-	for (unsigned int i = 0; i < threads_.size(); i++)
-		threads_[i].join();
+	std::shared_ptr<JobState> job;
+	{
+		std::unique_lock<std::mutex> lock(pool_.mutex);
+		if (pool_.restartRequested == false)
+		{
+			pool_.restartRequested = true;
+			pool_.restartTime = nc::TimeStamp::now();
+		}
+		pool_.numActive = 0;
+		job.swap(pool_.job);
+	}
+
+	pool_.generation++;
+	{
+		// Threads waiting for a pass have to see the new generation
+		std::unique_lock<std::mutex> lock(pool_.mutex);
+		pool_.passCondition.notify_all();
+	}
+	// Threads that have seen the old generation are still copying a tile to the frame
+	if (job)
+	{
+		while (job->numCommitting.load() > 0)
+			std::this_thread::yield();
+	}
+}
+
+void ThreadManager::waitIdle()
+{
+	// Jobs of stopped renders might still be reading the world
+	while (pool_.numJobSystemRenders.load() > 0)
+		std::this_thread::yield();
 
-	threads_.clear();
-#else
-	for (unsigned int i = 0; i < threads_.size(); i++)
-		threads_[i].join();
+	std::unique_lock<std::mutex> lock(pool_.mutex);
+	pool_.parkCondition.wait(lock, [this] { return pool_.numParked == numPoolThreads_; });
+}
 
-	threads_.clear();
-	tls_.clear();
-	args_.clear();
-#endif
+void ThreadManager::wait()
+{
+	std::unique_lock<std::mutex> lock(pool_.mutex);
+	pool_.doneCondition.wait(lock, [this] { return threadsRunning() == false; });
+}
+
+/*! Rows are split in contiguous bands like the work stealing queues of the first pass with row major order.
+ *  Combined with the node round-robin placement, every band ends up in the memory of the node that renders it. */
+void ThreadManager::firstTouch(pm::RGBColor *frame, int width, int height)
+{
+	stop();
+
+	if (isPoolBackend(config_.backend) == false)
+	{
+		// The whole frame is touched by the calling thread, the one that renders it
+		JobState job;
+		job.conf = config_;
+		job.conf.numThreads = 1;
+		job.conf.frame = frame;
+		job.width = width;
+		job.height = height;
+		firstTouchJob(0, job);
+		return;
+	}
+
+	const unsigned int numThreads = config_.numThreads;
+	preparePool(numThreads);
+
+	std::shared_ptr<JobState> job = std::make_shared<JobState>();
+	job->type = JobType::FIRST_TOUCH;
+	job->conf = config_;
+	job->conf.frame = frame;
+	job->generation = pool_.generation.load();
+	job->width = width;
+	job->height = height;
+	job->numWorkers = numThreads;
+	launchJob(job);
+
+	while (job->completedTiles.load() < static_cast<int>(numThreads))
+		std::this_thread::yield();
+}
+
+void ThreadManager::setNumThreads(unsigned int numThreads)
+{
+	config_.numThreads = numThreads;
+	if (threadsRunning() == false || isSingleThreadBackend(job_->conf.backend))
+		return;
+
+	if (numThreads > job_->numQueues)
+		numThreads = job_->numQueues;
+	else if (numThreads < 1)
+		numThreads = 1;
+
+	std::unique_lock<std::mutex> lock(pool_.mutex);
+	job_->numWorkers = numThreads;
+	if (job_->conf.scheduler == Scheduler::STATIC_INTERLEAVE)
+		rebindInterleavedThreads(*job_);
+	pool_.passCondition.notify_all();
+
+	// Parked threads that have not worked on the render yet are woken up to join it
+	if (isPoolBackend(job_->conf.backend) && numThreads > pool_.numActive)
+	{
+		pool_.numActive = numThreads;
+		pool_.wakeCondition.notify_all();
+	}
 }
 
 bool ThreadManager::threadsRunning() const
 {
-	return !stopThreads && progress() < 1.0f;
+	if (job_ == nullptr || job_->generation != pool_.generation.load())
+		return false;
+
+	// Progress is only an estimate, the render is over when the last pass has been published
+	return job_->pass.load() < job_->numPasses;
+}
+
+void ThreadManager::collectDirtyTiles(nctl::Array<DirtyTile> &dirtyTiles)
+{
+	// Single threaded backends complete the frame before returning, it is always copied as a whole
+	if (job_ == nullptr || job_->dirtyTiles == nullptr)
+		return;
+
+	for (int i = 0; i < job_->numTiles; i++)
+	{
+		// Most tiles are clean, they are only read to avoid writing their cache lines
+		if (job_->dirtyTiles[i].load() == 0 || job_->dirtyTiles[i].exchange(0) == 0)
+			continue;
+
+		DirtyTile &dirtyTile = dirtyTiles.emplaceBack();
+		setTileRegion(*job_, i, dirtyTile);
+	}
+}
+
+ThreadManager::PixelSamples ThreadManager::pixelSamples(int width, int height) const
+{
+	if (job_ == nullptr || job_->pixelSamples == nullptr || job_->width != width || job_->height != height)
+		return PixelSamples();
+
+	return PixelSamples(job_->pixelSamples.get(), job_->generation);
+}
+
+int ThreadManager::numConvergedTiles() const
+{
+	return (job_ != nullptr) ? job_->numConvergedTiles.load() : 0;
+}
+
+int ThreadManager::numTiles() const
+{
+	return (job_ != nullptr) ? job_->numTiles : 0;
+}
+
+float ThreadManager::renderTime() const
+{
+	return (job_ != nullptr) ? job_->renderTime.load() : 0.0f;
 }
 
 float ThreadManager::progress(unsigned int threadId) const
@@ -84,85 +471,1189 @@ float ThreadManager::progress(unsigned int threadId) const
 
 float ThreadManager::progress() const
 {
-	const unsigned long numThreads = tls_.size();
+	if (job_ == nullptr || job_->numPasses <= 0 || job_->numTiles <= 0)
+		return 0.0f;
 
-	float totalProgress = 0.0f;
-	for (unsigned int i = 0; i < numThreads; i++)
-		totalProgress += tls_[i].progress;
-	totalProgress /= static_cast<float>(numThreads);
+	const int pass = job_->pass.load();
+	if (pass >= job_->numPasses)
+		return 1.0f;
+
+	const int samplesPerPass = job_->samplesPerPass.load();
+	// Threads of the static interleave scheduler can be on different passes, the unit samples are never reset
+	if (job_->conf.scheduler == Scheduler::STATIC_INTERLEAVE)
+	{
+		const float samplesProgress = job_->completedUnitSamples.load() / static_cast<float>(job_->numUnits[0] * job_->numSamples);
+		return (samplesProgress < 1.0f) ? samplesProgress : 1.0f;
+	}
+
+	const float passProgress = job_->completedUnitSamples.load() / static_cast<float>(job_->numUnits[pass % 2] * samplesPerPass);
+	const float samplesProgress = (job_->completedSamples.load() + samplesPerPass * passProgress) / static_cast<float>(job_->numSamples);
+	if (job_->conf.totalBudget > 0.0f)
+	{
+		const float timeProgress = job_->startTime.secondsSince() / job_->conf.totalBudget;
+		if (timeProgress > samplesProgress)
+			return (timeProgress < 1.0f) ? timeProgress : 1.0f;
+	}
+	return (samplesProgress < 1.0f) ? samplesProgress : 1.0f;
+}
+
+int ThreadManager::numTileUnits() const
+{
+	if (job_ == nullptr || job_->numPasses <= 0)
+		return 0;
+
+	int pass = job_->pass.load();
+	if (pass >= job_->numPasses)
+		pass = job_->numPasses - 1;
+	return job_->numUnits[pass % 2];
+}
+
+int ThreadManager::samplesPerPass() const
+{
+	return (job_ != nullptr) ? job_->samplesPerPass.load() : 0;
+}
 
-	return totalProgress;
+int ThreadManager::completedSamples() const
+{
+	return (job_ != nullptr) ? job_->completedSamples.load() : 0;
+}
+
+/*! Every accumulated sample is weighted by the inverse of the total number of samples */
+float ThreadManager::frameScale() const
+{
+	if (job_ == nullptr || job_->numSamples <= 0)
+		return 1.0f;
+
+	// During the first pass the rendered pixels already have all of its samples
+	int samples = job_->completedSamples.load();
+	if (samples == 0)
+		samples = job_->samplesPerPass.load();
+	return (samples > 0) ? job_->numSamples / static_cast<float>(samples) : 1.0f;
 }
 
 ///////////////////////////////////////////////////////////
 // PRIVATE FUNCTIONS
 ///////////////////////////////////////////////////////////
 
-#if STD_THREADS
-void ThreadManager::threadFunc(int id, Configuration &conf, LocalStorage &tls)
+void ThreadManager::preparePool(unsigned int numThreads)
+{
+	// Threads hold pointers to their local storage, the pool can only grow by recreating it
+	if (numThreads > numPoolThreads_ || config_.placement != poolPlacement_ || config_.backend != poolBackend_)
+	{
+		destroyPool();
+		createPool(poolCapacity(numThreads));
+	}
+}
+
+void ThreadManager::createPool(unsigned int numThreads)
+{
+	ASSERT(numPoolThreads_ == 0);
+
+	// Pool threads start parked, waiting for the first job
+	pool_.exit = false;
+	pool_.numActive = 0;
+	pool_.numParked = 0;
+	numPoolThreads_ = numThreads;
+	poolPlacement_ = config_.placement;
+	poolBackend_ = config_.backend;
+
+	const CpuTopology topology(nc::Thread::numProcessors());
+	nctl::Array<int> cpuOrder;
+	const char *placementName = "logical";
+	switch (poolPlacement_)
+	{
+		case Placement::LOGICAL:
+			for (unsigned int i = 0; i < topology.numCpus(); i++)
+				cpuOrder.pushBack(static_cast<int>(i));
+			break;
+		case Placement::PHYSICAL_FIRST:
+			topology.physicalFirstOrder(cpuOrder);
+			placementName = "physical cores first";
+			break;
+		case Placement::NODE_ROUND_ROBIN:
+			topology.nodeRoundRobinOrder(cpuOrder);
+			placementName = "NUMA node round-robin";
+			break;
+	}
+	if (cpuOrder.isEmpty())
+		cpuOrder.pushBack(0);
+
+	LOGI_X("Thread backend: %s, placement: %s, %u threads on %u logical CPUs, %u cores, %u NUMA nodes",
+	       (poolBackend_ == Backend::STD_THREAD) ? "std::thread" : "nc::Thread", placementName, numThreads, topology.numCpus(), topology.numCores(), topology.numNodes());
+	for (unsigned int i = 0; i < numThreads; i++)
+	{
+		const int cpuIndex = cpuOrder[i % cpuOrder.size()];
+		const CpuTopology::Cpu &cpu = topology.cpu(cpuIndex);
+		LOGI_X("Thread#%.2u on CPU %d (package %d, core %d, node %d)", i, cpuIndex, cpu.package, cpu.core, cpu.node);
+	}
+
+	// Arguments and local storage are never reallocated, threads keep pointers to them
+	tls_.setCapacity(numThreads);
+	args_.setCapacity(numThreads);
+	for (unsigned int i = 0; i < numThreads; i++)
+	{
+		tls_.emplaceBack();
+		args_.emplaceBack(i, &tls_[i], &pool_);
+	}
+
+	if (poolBackend_ == Backend::STD_THREAD)
+	{
+		stdThreads_.reserve(numThreads);
+		for (unsigned int i = 0; i < numThreads; i++)
+		{
+			stdThreads_.emplace_back(threadFunc, &args_[i]);
+#if defined(__linux__) && !defined(__ANDROID__)
+			cpu_set_t cpuSet;
+			CPU_ZERO(&cpuSet);
+			CPU_SET(cpuOrder[i % cpuOrder.size()], &cpuSet);
+			pthread_setaffinity_np(stdThreads_.back().native_handle(), sizeof(cpu_set_t), &cpuSet);
+#endif
+		}
+	}
+	else
+	{
+		ncThreads_.setCapacity(numThreads);
+		for (unsigned int i = 0; i < numThreads; i++)
+		{
+			ncThreads_.emplaceBack();
+			ncThreads_.back().run(threadFunc, &args_[i]);
+#if !defined(__ANDROID__) && !defined(__EMSCRIPTEN__)
+			ncThreads_.back().setAffinityMask(nc::ThreadAffinityMask(cpuOrder[i % cpuOrder.size()]));
+#endif
+		}
+	}
+}
+
+void ThreadManager::destroyPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(pool_.mutex);
+		pool_.exit = true;
+		pool_.wakeCondition.notify_all();
+	}
+
+	for (unsigned int i = 0; i < stdThreads_.size(); i++)
+		stdThreads_[i].join();
+	for (unsigned int i = 0; i < ncThreads_.size(); i++)
+		ncThreads_[i].join();
+
+	stdThreads_.clear();
+	ncThreads_.clear();
+	args_.clear();
+	tls_.clear();
+	numPoolThreads_ = 0;
+}
+
+/*! Retired states with a different frame or tiles are released, the others can be reused once no thread references them.
+ *  \returns A state with its arrays allocated and its counters reset, or `nullptr` if none can be reused */
+std::shared_ptr<ThreadManager::JobState> ThreadManager::reuseJob(int width, int height, unsigned int numQueues)
+{
+	std::shared_ptr<JobState> job;
+	for (int i = static_cast<int>(retiredJobs_.size()) - 1; i >= 0; i--)
+	{
+		const JobState &retiredJob = *retiredJobs_[i];
+		if (retiredJob.width != width || retiredJob.height != height || retiredJob.conf.tileSize != config_.tileSize || retiredJob.numQueues != numQueues)
+			retiredJobs_.removeAt(i);
+		else if (job == nullptr && retiredJobs_[i].use_count() == 1)
+		{
+			job = retiredJobs_[i];
+			retiredJobs_.removeAt(i);
+		}
+	}
+	if (job == nullptr)
+		return nullptr;
+
+	// Threads of the stopped render released their references, their last writes to the arrays have to be visible
+	std::atomic_thread_fence(std::memory_order_acquire);
+	ASSERT(job->numCommitting.load() == 0);
+	job->pass = 0;
+	job->completedTiles = 0;
+	job->completedUnitSamples = 0;
+	job->numInterleavingThreads = 0;
+	job->completedSamples = 0;
+	job->numUnits[0] = 0;
+	job->numUnits[1] = 0;
+	job->numConvergedTiles = 0;
+	job->renderTime = 0.0f;
+	return job;
+}
+
+/*! Only the states of multithreaded renders have arrays worth keeping, the oldest one is released when there are too many */
+void ThreadManager::retireJob()
+{
+	if (job_ == nullptr || job_->units[0] == nullptr)
+		return;
+
+	if (retiredJobs_.size() >= MaxRetiredJobs)
+		retiredJobs_.removeAt(0);
+	retiredJobs_.pushBack(job_);
+}
+
+void ThreadManager::launchJob(const std::shared_ptr<JobState> &job)
 {
-#else
+	if (job->conf.backend == Backend::JOB_SYSTEM)
+	{
+		{
+			// Pool threads are not woken up, the job is only needed by a stop to wait for the commits
+			std::unique_lock<std::mutex> lock(pool_.mutex);
+			pool_.job = job;
+			pool_.restartRequested = false;
+			pool_.numAwake = 0;
+			job->restartTime = pool_.restartTime;
+		}
+		job->jobSystemSelf = job;
+		pool_.numJobSystemRenders++;
+		submitJobSystemPass(*job, pool_);
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(pool_.mutex);
+	pool_.job = job;
+	pool_.restartRequested = false;
+	pool_.numAwake = 0;
+	pool_.numActive = job->numWorkers.load();
+	pool_.jobId++;
+	pool_.wakeCondition.notify_all();
+}
+
 void ThreadManager::threadFunc(void *arg)
 {
 	ThreadArg *threadArg = reinterpret_cast<ThreadArg *>(arg);
 	const int id = threadArg->id_;
-	const Configuration &conf = *threadArg->conf_;
 	LocalStorage &tls = *threadArg->tls_;
+	PoolState &pool = *threadArg->pool_;
 
-	#if !defined(__EMSCRIPTEN__)
+#if !defined(__EMSCRIPTEN__)
 	nctl::String threadName;
 	threadName.format("Thread#%.2d", id);
 	nc::ThisThread::setName(threadName.data());
-	#endif
 #endif
-	ZoneScoped;
-	tls.hasFinished = false;
-	tls.progress = 0.0f;
+	unsigned int jobId = 0;
+
+	while (true)
+	{
+		std::shared_ptr<JobState> job;
+		nc::TimeStamp restartTime;
+		{
+			std::unique_lock<std::mutex> lock(pool.mutex);
+			pool.numParked++;
+			pool.parkCondition.notify_all();
+			pool.wakeCondition.wait(lock, [&] { return pool.exit || (pool.jobId != jobId && static_cast<unsigned int>(id) < pool.numActive); });
+			pool.numParked--;
+
+			if (pool.exit)
+				break;
+			jobId = pool.jobId;
+			job = pool.job;
+			restartTime = pool.restartTime;
+		}
 
-	const int width = conf.world->viewPlane().width();
-	const int height = conf.world->viewPlane().height();
-	const int maxSamples = conf.world->viewPlane().samplerState().numSamples();
+		if (pool.numAwake.fetch_add(1) + 1 == job->conf.numThreads)
+			pool.restartLatency = restartTime.secondsSince();
 
-	const int numColumns = (width / conf.tileSize) + 1;
-	const int numRows = (height / conf.tileSize) + 1;
+		if (job->type == JobType::FIRST_TOUCH)
+			firstTouchJob(id, *job);
+		else
+			renderJob(id, *job, tls, pool);
+	}
+}
 
-	int iteration = 0;
-	int sample = 0;
+/*! Every pass is a parent job with one child per configured thread, all claiming units from the shared cursor,
+ *  followed by a continuation that advances to the next pass */
+void ThreadManager::submitJobSystemPass(JobState &job, PoolState &pool)
+{
+	nc::IJobSystem &jobSystem = nc::theServiceLocator().jobSystem();
+	JobSystemData data = { &job, &pool, 0 };
 
-	while (tls.hasFinished == false && stopThreads == false)
+	const nc::JobId parentJob = jobSystem.createJob(jobSystemBatch, &data, sizeof(JobSystemData));
+	const unsigned int numBatches = job.numWorkers.load();
+	for (unsigned int i = 1; i < numBatches; i++)
 	{
-		ZoneScopedN("Tiled renderScene");
+		data.batchIndex = i;
+		jobSystem.run(jobSystem.createJobAsChild(parentJob, jobSystemBatch, &data, sizeof(JobSystemData)));
+	}
+	const nc::JobId continuationJob = jobSystem.createJob(jobSystemPass, &data, sizeof(JobSystemData));
+	jobSystem.addContinuation(parentJob, continuationJob);
+	jobSystem.run(parentJob);
+}
 
-		const int index = (iteration * conf.numThreads) + id;
-		int column = index % numColumns;
-		int row = index / numColumns;
+void ThreadManager::jobSystemBatch(nc::JobId, const void *data)
+{
+	ZoneScoped;
+	const JobSystemData &jobData = *static_cast<const JobSystemData *>(data);
+	JobState &job = *jobData.job;
+	PoolState &pool = *jobData.pool;
 
-		if (row > numRows - 1)
-		{
-			iteration = 0;
-			sample++;
-			if (sample > maxSamples)
-			{
-				tls.hasFinished = true;
-				tls.progress = 1.0f;
-				break;
-			}
-			continue;
-		}
+	// Job system threads are not owned by the manager, their tile buffers are kept in thread local storage
+	static thread_local LocalStorage tls;
+	const int alignmentPixels = prepareTileBuffer(job, tls);
+	const int pass = job.pass.load();
 
-		const int startX = column * conf.tileSize;
-		const int startY = row * conf.tileSize;
-		const int tileSizeX = (startX + conf.tileSize > width) ? width - startX : conf.tileSize;
-		const int tileSizeY = (startY + conf.tileSize > height) ? height - startY : conf.tileSize;
+	// As with the pool threads, the restart is over when the last batch of the first pass starts
+	if (pass == 0 && job.generation == pool.generation.load() && pool.numAwake.fetch_add(1) + 1 == job.numWorkers.load())
+		pool.restartLatency = job.restartTime.secondsSince();
 
-		nctl::StaticString<64> zoneTextString;
-		zoneTextString.format("Index: %d - Col: %d, Row: %d - (%d, %d), (%d, %d)",
-		                      index, column, row, startX, startY, startX + tileSizeX, startY + tileSizeY);
-		ZoneText(zoneTextString.data(), zoneTextString.length());
+	// Batches above the limit leave the rest of the pass to the others, the first one always completes it
+	while (job.generation == pool.generation.load() &&
+	       jobData.batchIndex < pool.threadsLimit.load() && jobData.batchIndex < job.numWorkers.load())
+	{
+		const int position = claimTile(0, pass, job);
+		if (position < 0)
+			break;
+
+		TileUnit &unit = job.units[pass % 2][position];
+		const int numUnitSamples = job.samplesPerPass.load();
+		if (processUnit(job, unit, numUnitSamples, job.completedSamples.load() + numUnitSamples, tls, alignmentPixels, pool) == false)
+			break;
+		job.completedTiles++;
 
-		conf.camera->renderScene(*conf.world, *conf.tracer, conf.frame, startX, startY, tileSizeX, tileSizeY, true);
-		iteration++;
+		if (job.conf.yieldBetweenTiles)
+			std::this_thread::yield();
+	}
+}
+
+/*! It runs on a job system thread when all the units of a pass have been rendered, or skipped because the render has been stopped */
+void ThreadManager::jobSystemPass(nc::JobId, const void *data)
+{
+	const JobSystemData &jobData = *static_cast<const JobSystemData *>(data);
+	JobState &job = *jobData.job;
+	PoolState &pool = *jobData.pool;
+
+	if (job.generation == pool.generation.load())
+	{
+		advancePass(job, pool);
+		if (job.pass.load() < job.numPasses)
+		{
+			submitJobSystemPass(job, pool);
+			return;
+		}
+	}
+
+	// The manager can be destroyed as soon as the counter reaches zero, the state only when the reference is released
+	std::shared_ptr<JobState> self;
+	self.swap(job.jobSystemSelf);
+	pool.numJobSystemRenders--;
+}
+
+/*! Samples are not progressive, the frame is completed in a single pass */
+void ThreadManager::renderOnCallingThread(JobState &job)
+{
+	ZoneScoped;
+	const Configuration &conf = job.conf;
+	if (conf.backend == Backend::SINGLE)
+		conf.camera->renderScene(*conf.world, *conf.tracer, conf.frame);
+	else
+	{
+		for (int i = 0; i < job.height; i += conf.tileSize)
+		{
+			for (int j = 0; j < job.width; j += conf.tileSize)
+				conf.camera->renderScene(*conf.world, *conf.tracer, conf.frame, j, i, conf.tileSize);
+		}
+	}
+
+	job.completedSamples = job.numSamples;
+	job.renderTime = job.startTime.secondsSince();
+	job.pass = job.numPasses;
+}
+
+void ThreadManager::firstTouchJob(int id, JobState &job)
+{
+	const int numThreads = static_cast<int>(job.conf.numThreads);
+	const int startRow = (job.height * id) / numThreads;
+	const int endRow = (job.height * (id + 1)) / numThreads;
+
+	for (int y = startRow; y < endRow; y++)
+	{
+		pm::RGBColor *frameRow = job.conf.frame + y * job.width;
+		for (int x = 0; x < job.width; x++)
+			new (frameRow + x) pm::RGBColor(0.0f, 0.0f, 0.0f);
+	}
+	job.completedTiles++;
+}
+
+void ThreadManager::renderJob(int id, JobState &job, LocalStorage &tls, PoolState &pool)
+{
+	ZoneScoped;
+	tls.hasFinished = false;
+	tls.progress = 0.0f;
+
+	const Configuration &conf = job.conf;
+	if (tls.niceness != conf.niceness)
+	{
+#if defined(__linux__)
+		// On Linux the nice value is a per-thread attribute
+		if (setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), conf.niceness) != 0)
+			LOGW_X("Cannot change the nice value of thread #%d from %d to %d", id, tls.niceness, conf.niceness);
+#endif
+		tls.niceness = conf.niceness;
+	}
+
+	const int alignmentPixels = prepareTileBuffer(job, tls);
+	if (conf.scheduler == Scheduler::STATIC_INTERLEAVE)
+	{
+		renderInterleavedJob(id, job, tls, alignmentPixels, pool);
+		return;
+	}
+
+	while (tls.hasFinished == false && job.generation == pool.generation.load())
+	{
+		const int pass = job.pass.load();
+		if (pass >= job.numPasses)
+		{
+			tls.hasFinished = true;
+			tls.progress = 1.0f;
+			break;
+		}
+
+		// Threads above the number of workers sleep until it grows, the ones above the limit pause between units
+		const unsigned int threadId = static_cast<unsigned int>(id);
+		if (threadId >= job.numWorkers.load())
+		{
+			std::unique_lock<std::mutex> lock(pool.mutex);
+			pool.passCondition.wait(lock, [&] {
+				return threadId < job.numWorkers.load() || job.pass.load() >= job.numPasses || job.generation != pool.generation.load();
+			});
+			continue;
+		}
+		else if (threadId >= pool.threadsLimit.load())
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+
+		const int position = claimTile(id, pass, job);
+		if (position < 0)
+		{
+			// No more units for this thread, it sleeps until the others complete the pass, unless it has already ended
+			waitForPass(pass, job, pool);
+			continue;
+		}
+
+		ZoneScopedN("Tiled renderScene");
+
+		// A unit is claimed only from the ranges of its pass, and a claimed unit keeps the pass from ending
+		const int unitPass = pass;
+		TileUnit &unit = job.units[unitPass % 2][position];
+		const int numUnitSamples = job.samplesPerPass.load();
+
+#ifdef TRACY_ENABLE
+		nctl::StaticString<64> zoneTextString;
+		zoneTextString.format("Unit: %d - (%d, %d), (%d, %d), %d samples", position, unit.x, unit.y, unit.x + unit.width, unit.y + unit.height, numUnitSamples);
+		ZoneText(zoneTextString.data(), zoneTextString.length());
+#endif
+
+		if (processUnit(job, unit, numUnitSamples, job.completedSamples.load() + numUnitSamples, tls, alignmentPixels, pool) == false)
+			break;
+
+		// The thread that completes the last unit of a pass starts the next one
+		const int numUnits = job.numUnits[unitPass % 2];
+		const int completedUnits = job.completedTiles.fetch_add(1) + 1;
+		if (completedUnits == numUnits)
+			advancePass(job, pool);
+
+		tls.progress = (job.completedSamples.load() + numUnitSamples * completedUnits / static_cast<float>(numUnits)) / static_cast<float>(job.numSamples);
+
+		if (conf.yieldBetweenTiles)
+			std::this_thread::yield();
+	}
+}
+
+/*! Units are bound to threads by their index, a thread that has rendered its units of a pass moves
+ *  to the next one without waiting for the others. The render pass is the one completed by the slowest thread. */
+void ThreadManager::renderInterleavedJob(int id, JobState &job, LocalStorage &tls, int alignmentPixels, PoolState &pool)
+{
+	const unsigned int threadId = static_cast<unsigned int>(id);
+	const int numUnits = job.numUnits[0];
+	const int samplesPerPass = job.samplesPerPass.load();
+	int pass = -1;
+	int numPassSamples = 0;
+	int index = 0;
+	unsigned int stride = 1;
+
+	while (job.generation == pool.generation.load())
+	{
+		if (pass < 0)
+		{
+			// Threads that cannot start a pass sleep until another one completes its own or the number of workers changes
+			std::unique_lock<std::mutex> lock(pool.mutex);
+			pool.passCondition.wait(lock, [&] {
+				return job.generation != pool.generation.load() || job.pass.load() >= job.numPasses || nextInterleavedPass(threadId, job) >= 0;
+			});
+			if (job.generation != pool.generation.load() || job.pass.load() >= job.numPasses)
+				break;
+
+			pass = nextInterleavedPass(threadId, job);
+			job.numInterleavingThreads++;
+			numPassSamples = std::min(samplesPerPass, job.numSamples - pass * samplesPerPass);
+			stride = job.passWorkers.load();
+			index = id;
+		}
+
+		if (index < numUnits)
+		{
+			// A stopped render is abandoned in the middle of a pass, its counters are not needed anymore
+			TileUnit &unit = job.units[0][index];
+			if (processUnit(job, unit, numPassSamples, pass * samplesPerPass + numPassSamples, tls, alignmentPixels, pool) == false)
+				break;
+			index += stride;
+
+			const int renderedUnits = (index < numUnits) ? index : numUnits;
+			tls.progress = (pass * samplesPerPass + numPassSamples * renderedUnits / static_cast<float>(numUnits)) / static_cast<float>(job.numSamples);
+
+			if (job.conf.yieldBetweenTiles)
+				std::this_thread::yield();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(pool.mutex);
+		job.threadPasses[id] = pass + 1;
+		job.numInterleavingThreads--;
+		completeInterleavedPass(job, pool);
+		pass = -1;
+	}
+
+	if (job.pass.load() >= job.numPasses)
+	{
+		tls.hasFinished = true;
+		tls.progress = 1.0f;
+	}
+}
+
+/*! It is called with the pool mutex locked.
+ *  \returns The pass the thread can start, or -1 if it has to wait */
+int ThreadManager::nextInterleavedPass(unsigned int threadId, const JobState &job)
+{
+	const unsigned int passWorkers = job.passWorkers.load();
+	if (threadId >= passWorkers)
+		return -1;
+
+	const int nextPass = job.threadPasses[threadId];
+	if (nextPass * job.samplesPerPass.load() >= job.numSamples)
+		return -1;
+
+	// While the number of workers changes, threads can only catch up with the others before units are rebound
+	if (job.numWorkers.load() != passWorkers)
+	{
+		int maxPasses = 0;
+		for (unsigned int i = 0; i < passWorkers; i++)
+			maxPasses = std::max(maxPasses, job.threadPasses[i]);
+		if (nextPass >= maxPasses)
+			return -1;
+	}
+
+	return nextPass;
+}
+
+/*! It is called with the pool mutex locked, after a thread has completed one of its passes */
+void ThreadManager::completeInterleavedPass(JobState &job, PoolState &pool)
+{
+	const unsigned int passWorkers = job.passWorkers.load();
+	int minPasses = job.threadPasses[0];
+	for (unsigned int i = 1; i < passWorkers; i++)
+		minPasses = std::min(minPasses, job.threadPasses[i]);
+
+	const int samplesPerPass = job.samplesPerPass.load();
+	if (minPasses * samplesPerPass >= job.numSamples)
+	{
+		job.completedSamples = job.numSamples;
+		job.renderTime = job.startTime.secondsSince();
+		job.pass = job.numPasses;
+		pool.doneCondition.notify_all();
+	}
+	else
+	{
+		// Every pixel has accumulated the samples of the passes completed by the slowest thread
+		if (job.pass.load() < minPasses)
+		{
+			job.completedSamples = minPasses * samplesPerPass;
+			job.pass = minPasses;
+		}
+		rebindInterleavedThreads(job);
+	}
+	pool.passCondition.notify_all();
+}
+
+/*! It is called with the pool mutex locked. Units are rebound only when no thread is in the middle of a pass
+ *  and all of them have completed the same number of passes. */
+void ThreadManager::rebindInterleavedThreads(JobState &job)
+{
+	const unsigned int passWorkers = job.passWorkers.load();
+	const unsigned int numWorkers = job.numWorkers.load();
+	if (numWorkers == passWorkers || job.numInterleavingThreads > 0)
+		return;
+
+	const int numPasses = job.threadPasses[0];
+	for (unsigned int i = 1; i < passWorkers; i++)
+	{
+		if (job.threadPasses[i] != numPasses)
+			return;
+	}
+
+	for (unsigned int i = passWorkers; i < numWorkers; i++)
+		job.threadPasses[i] = numPasses;
+	job.passWorkers = numWorkers;
+}
+
+void ThreadManager::waitForPass(int pass, const JobState &job, PoolState &pool)
+{
+	std::unique_lock<std::mutex> lock(pool.mutex);
+	pool.passCondition.wait(lock, [&] { return job.pass.load() != pass || job.generation != pool.generation.load(); });
+}
+
+/*! \returns The number of pixels after which the tile buffer is aligned to a cache line again */
+int ThreadManager::prepareTileBuffer(const JobState &job, LocalStorage &tls)
+{
+	int alignmentPixels = 1;
+	while ((alignmentPixels * sizeof(pm::RGBColor)) % CacheLineSize != 0)
+		alignmentPixels++;
+
+	// The tile buffer has the same row stride as the frame, as the camera addresses pixels with it.
+	// Only adaptive tiles merge groups of tiles in units that are two tiles high.
+	const int maxUnitRows = job.conf.adaptiveTiles ? 2 * job.conf.tileSize : job.conf.tileSize;
+	const unsigned int tileBufferSize = static_cast<unsigned int>(maxUnitRows * job.width + alignmentPixels);
+	if (job.conf.tileBuffers && tls.tileBufferSize < tileBufferSize)
+	{
+		const unsigned int paddingPixels = CacheLineSize / sizeof(pm::RGBColor) + 1;
+		tls.tileBufferMemory = nctl::makeUnique<pm::RGBColor[]>(tileBufferSize + paddingPixels);
+		const uintptr_t address = reinterpret_cast<uintptr_t>(tls.tileBufferMemory.get());
+		tls.tileBuffer = reinterpret_cast<pm::RGBColor *>((address + CacheLineSize - 1) & ~static_cast<uintptr_t>(CacheLineSize - 1));
+		tls.tileBufferSize = tileBufferSize;
+	}
+
+	return alignmentPixels;
+}
+
+/*! \returns False if the render has been stopped and the unit discarded */
+bool ThreadManager::processUnit(JobState &job, TileUnit &unit, int numUnitSamples, int unitSamples, LocalStorage &tls, int alignmentPixels, const PoolState &pool)
+{
+	const Configuration &conf = job.conf;
+	const int width = job.width;
+
+	const nc::TimeStamp unitStartTime = nc::TimeStamp::now();
+	bool isCurrent = true;
+	if (conf.tileBuffers)
+	{
+		// The first pixel of the unit starts a cache line
+		pm::RGBColor *tileBuffer = tls.tileBuffer + (alignmentPixels - unit.x % alignmentPixels) % alignmentPixels;
+
+		// Progressive rendering adds a weighted sample to every pixel, the tile buffer has to be cleared first
+		for (int y = 0; y < unit.height; y++)
+		{
+			for (int x = unit.x; x < unit.x + unit.width; x++)
+				tileBuffer[y * width + x].set(0.0f, 0.0f, 0.0f);
+		}
+		// The camera uses frame coordinates, the origin is moved up by the unit rows so that the first one lands on the buffer.
+		// It is computed as an address, a pointer before the start of the buffer would be out of its bounds.
+		const uintptr_t frameOrigin = reinterpret_cast<uintptr_t>(tileBuffer) - static_cast<uintptr_t>(unit.y) * width * sizeof(pm::RGBColor);
+		renderUnit(job, unit, numUnitSamples, reinterpret_cast<pm::RGBColor *>(frameOrigin));
+		unit.cost = unitStartTime.secondsSince();
+
+		// The commit is announced before checking the generation, so that a stopping thread cannot miss it
+		job.numCommitting++;
+		isCurrent = (job.generation == pool.generation.load());
+		if (isCurrent)
+		{
+			for (int y = 0; y < unit.height; y++)
+			{
+				pm::RGBColor *frameRow = conf.frame + (unit.y + y) * width;
+				const pm::RGBColor *tileRow = tileBuffer + y * width;
+				for (int x = unit.x; x < unit.x + unit.width; x++)
+					frameRow[x] += tileRow[x];
+			}
+			storePixelSamples(job, unit, unitSamples);
+			// The frame is read back while a stopping thread still waits for the commit
+			if (job.pixelMoments)
+				unit.error = updatePixelMoments(job, unit, numUnitSamples, tileBuffer);
+		}
+		job.numCommitting--;
+	}
+	else
+	{
+		// Without a tile buffer the whole render of the unit is a commit, a stopping thread has to wait for it
+		job.numCommitting++;
+		isCurrent = (job.generation == pool.generation.load());
+		if (isCurrent)
+		{
+			renderUnit(job, unit, numUnitSamples, conf.frame);
+			storePixelSamples(job, unit, unitSamples);
+		}
+		job.numCommitting--;
+		unit.cost = unitStartTime.secondsSince();
+	}
+
+	// Tiles are marked after the samples of their pixels, a collected tile is never missing the ones of its last commit
+	if (isCurrent)
+		markDirtyTiles(job, unit);
+	return isCurrent;
+}
+
+void ThreadManager::renderUnit(JobState &job, const TileUnit &unit, int numSamples, pm::RGBColor *frame)
+{
+	const Configuration &conf = job.conf;
+	for (int i = 0; i < numSamples; i++)
+	{
+		conf.camera->renderScene(*conf.world, *conf.tracer, frame, unit.x, unit.y, unit.width, unit.height, true);
+		job.completedUnitSamples++;
+	}
+}
+
+/*! A unit can be a part of a tile or a group of them, every tile it touches is marked */
+void ThreadManager::markDirtyTiles(JobState &job, const TileUnit &unit)
+{
+	const int tileSize = job.conf.tileSize;
+	const int firstColumn = unit.x / tileSize;
+	const int lastColumn = (unit.x + unit.width - 1) / tileSize;
+	const int firstRow = unit.y / tileSize;
+	const int lastRow = (unit.y + unit.height - 1) / tileSize;
+
+	for (int row = firstRow; row <= lastRow; row++)
+	{
+		for (int column = firstColumn; column <= lastColumn; column++)
+			job.dirtyTiles[row * job.numColumns + column] = 1;
+	}
+}
+
+void ThreadManager::storePixelSamples(JobState &job, const TileUnit &unit, int unitSamples)
+{
+	const uint64_t stampedSamples = (static_cast<uint64_t>(job.generation) << 32) | static_cast<uint32_t>(unitSamples);
+	for (int y = unit.y; y < unit.y + unit.height; y++)
+	{
+		std::atomic<uint64_t> *samplesRow = job.pixelSamples.get() + y * job.width;
+		for (int x = unit.x; x < unit.x + unit.width; x++)
+			samplesRow[x].store(stampedSamples, std::memory_order_relaxed);
+	}
+}
+
+/*! Visits are batches of samples, the variance of a sample is estimated from the spread of their mean luminance around
+ *  the one of the pixel. Tiles that are still sampled have been visited in every pass, they share the same number of samples.
+ *  \returns The maximum relative error of the mean of the unit pixels */
+float ThreadManager::updatePixelMoments(JobState &job, const TileUnit &unit, int numUnitSamples, const pm::RGBColor *tileBuffer)
+{
+	const int width = job.width;
+	const int numSamples = job.completedSamples.load() + numUnitSamples;
+	const int numVisits = job.pass.load() + 1;
+	// Samples are weighted by the inverse of their total number, luminance is brought back to the one of a single sample
+	const float sampleScale = static_cast<float>(job.numSamples);
+
+	float maxError = 0.0f;
+	for (int y = 0; y < unit.height; y++)
+	{
+		const int rowIndex = (unit.y + y) * width;
+		const pm::RGBColor *tileRow = tileBuffer + y * width;
+		for (int x = unit.x; x < unit.x + unit.width; x++)
+		{
+			const float visitLuminance = luminance(tileRow[x]) * sampleScale;
+			float &moment = job.pixelMoments[rowIndex + x];
+			moment += visitLuminance * visitLuminance / numUnitSamples;
+			if (numVisits < 2)
+				continue;
+
+			const float mean = luminance(job.conf.frame[rowIndex + x]) * sampleScale / numSamples;
+			const float variance = (moment - numSamples * mean * mean) / (numVisits - 1);
+			const float error = (variance > 0.0f) ? sqrtf(variance / numSamples) / std::max(mean, MinErrorLuminance) : 0.0f;
+			if (error > maxError)
+				maxError = error;
+		}
+	}
+
+	// A single visit tells nothing about the variance
+	return (numVisits < 2) ? HUGE_VALF : maxError;
+}
+
+/*! A tile converges when the error of all of its pixels in the last pass is below the threshold */
+void ThreadManager::updateConvergedTiles(JobState &job)
+{
+	const int completedSamples = job.completedSamples.load();
+	if (completedSamples < MinConvergedSamples)
+		return;
+
+	const int tileSize = job.conf.tileSize;
+	const int numColumns = job.numColumns;
+	for (int i = 0; i < job.numTiles; i++)
+		job.tileErrors[i] = 0.0f;
+
+	// Units are from the pass that has just completed, which is still the current one
+	const int lastIndex = job.pass.load() % 2;
+	const int numLastUnits = job.numUnits[lastIndex];
+	for (int i = 0; i < numLastUnits; i++)
+	{
+		const TileUnit &unit = job.units[lastIndex][i];
+		for (int row = unit.y / tileSize; row <= (unit.y + unit.height - 1) / tileSize; row++)
+		{
+			for (int column = unit.x / tileSize; column <= (unit.x + unit.width - 1) / tileSize; column++)
+			{
+				float &tileError = job.tileErrors[row * numColumns + column];
+				tileError = std::max(tileError, unit.error);
+			}
+		}
+	}
+
+	for (int i = 0; i < job.numTiles; i++)
+	{
+		if (job.convergedSamples[i].load() == 0 && job.tileErrors[i] < job.conf.errorThreshold)
+		{
+			job.convergedSamples[i] = completedSamples;
+			job.numConvergedTiles++;
+		}
+	}
+}
+
+void ThreadManager::setTileRegion(const JobState &job, int index, DirtyTile &tile)
+{
+	const int tileSize = job.conf.tileSize;
+	tile.x = (index % job.numColumns) * tileSize;
+	tile.y = (index / job.numColumns) * tileSize;
+	tile.width = (tile.x + tileSize <= job.width) ? tileSize : job.width - tile.x;
+	tile.height = (tile.y + tileSize <= job.height) ? tileSize : job.height - tile.y;
+}
+
+/*! \returns The position in the visiting order of the tile to render, or -1 if there are no more tiles for the thread in the pass
+ *  or if the queues have not been filled for that pass */
+int ThreadManager::claimTile(int id, int pass, JobState &job)
+{
+	const Configuration &conf = job.conf;
+	switch (conf.scheduler)
+	{
+		case Scheduler::STATIC_INTERLEAVE:
+			// Units are bound to threads by their index, they are never claimed
+			return -1;
+		case Scheduler::SHARED_CURSOR:
+		{
+			// The number of units travels with the cursor, a claim cannot cross the boundary of a pass
+			uint64_t cursor = job.cursor.load();
+			while (isRangeOfPass(cursor, pass) && rangeBegin(cursor) < rangeEnd(cursor))
+			{
+				if (job.cursor.compare_exchange_weak(cursor, packRange(pass, rangeBegin(cursor) + 1, rangeEnd(cursor))))
+					return rangeBegin(cursor);
+			}
+			return -1;
+		}
+		case Scheduler::WORK_STEALING:
+		{
+			// Pop a tile from the front of the own queue
+			TileQueue &ownQueue = job.queues[id];
+			uint64_t range = ownQueue.range.load();
+			while (isRangeOfPass(range, pass) && rangeBegin(range) < rangeEnd(range))
+			{
+				if (ownQueue.range.compare_exchange_weak(range, packRange(pass, rangeBegin(range) + 1, rangeEnd(range))))
+					return rangeBegin(range);
+			}
+
+			// Steal a tile from the back of another queue, also from the ones of paused threads
+			for (unsigned int i = 1; i < job.numQueues; i++)
+			{
+				TileQueue &victimQueue = job.queues[(id + i) % job.numQueues];
+				range = victimQueue.range.load();
+				while (isRangeOfPass(range, pass) && rangeBegin(range) < rangeEnd(range))
+				{
+					if (victimQueue.range.compare_exchange_weak(range, packRange(pass, rangeBegin(range), rangeEnd(range) - 1)))
+						return rangeEnd(range) - 1;
+				}
+			}
+			return -1;
+		}
+	}
+
+	return -1;
+}
+
+/*! Every thread receives a contiguous range of units, so that the owner walks through neighbouring ones */
+void ThreadManager::fillQueues(JobState &job, int pass, int numUnits)
+{
+	ASSERT(static_cast<uint64_t>(numUnits) <= RangeIndexMask);
+	const unsigned int numThreads = job.passWorkers.load();
+	for (unsigned int i = 0; i < job.numQueues; i++)
+	{
+		const uint32_t begin = static_cast<uint32_t>((numUnits * i) / numThreads);
+		const uint32_t end = static_cast<uint32_t>((numUnits * (i + 1)) / numThreads);
+		job.queues[i].range = (i < numThreads) ? packRange(pass, begin, end) : packRange(pass, 0, 0);
+	}
+	job.cursor = packRange(pass, 0, static_cast<uint32_t>(numUnits));
+}
+
+void ThreadManager::fillTileOrder(JobState &job)
+{
+	const int numColumns = job.numColumns;
+	const int numRows = job.numRows;
+	// A reused state already has an array of the right size
+	if (job.tileOrder == nullptr)
+		job.tileOrder = nctl::makeUnique<int[]>(job.numTiles);
+	if (job.conf.tileOrder == TileOrder::ROW_MAJOR)
+	{
+		for (int i = 0; i < job.numTiles; i++)
+			job.tileOrder[i] = i;
+		return;
+	}
+
+	uint32_t side = 1;
+	while (side < static_cast<uint32_t>(numColumns) || side < static_cast<uint32_t>(numRows))
+		side *= 2;
+
+	// The tile index is packed in the low bits to break ties and to be retrieved after sorting
+	nctl::UniquePtr<uint64_t[]> keys = nctl::makeUnique<uint64_t[]>(job.numTiles);
+	for (int index = 0; index < job.numTiles; index++)
+	{
+		const int column = index % numColumns;
+		const int row = index / numColumns;
+
+		uint32_t key = 0;
+		switch (job.conf.tileOrder)
+		{
+			case TileOrder::ROW_MAJOR:
+				key = static_cast<uint32_t>(index);
+				break;
+			case TileOrder::MORTON:
+				key = mortonCode(column, row);
+				break;
+			case TileOrder::HILBERT:
+				key = hilbertDistance(side, column, row);
+				break;
+			case TileOrder::SPIRAL:
+				key = spiralKey(column, row, numColumns, numRows);
+				break;
+		}
+		keys[index] = (static_cast<uint64_t>(key) << 32) | static_cast<uint32_t>(index);
+	}
+	std::sort(keys.get(), keys.get() + job.numTiles);
+
+	const unsigned int numThreads = job.conf.numThreads;
+	if (job.conf.tileOrder == TileOrder::SPIRAL && job.conf.scheduler == Scheduler::WORK_STEALING && numThreads > 1)
+	{
+		// Tiles are dealt to the queues in turn, so that every thread proceeds from the center outwards
+		nctl::UniquePtr<int[]> nextPositions = nctl::makeUnique<int[]>(numThreads);
+		for (unsigned int i = 0; i < numThreads; i++)
+			nextPositions[i] = rangeBegin(job.queues[i].range.load());
+
+		unsigned int queueIndex = 0;
+		for (int i = 0; i < job.numTiles; i++)
+		{
+			while (nextPositions[queueIndex] >= rangeEnd(job.queues[queueIndex].range.load()))
+				queueIndex = (queueIndex + 1) % numThreads;
+			job.tileOrder[nextPositions[queueIndex]++] = static_cast<int>(keys[i] & 0xFFFFFFFF);
+			queueIndex = (queueIndex + 1) % numThreads;
+		}
+	}
+	else
+	{
+		for (int i = 0; i < job.numTiles; i++)
+			job.tileOrder[i] = static_cast<int>(keys[i] & 0xFFFFFFFF);
+	}
+}
+
+int ThreadManager::maxTileSplit(int tileSize)
+{
+	const int maxSplit = tileSize / MinUnitSize;
+	if (maxSplit < 1)
+		return 1;
+	return (maxSplit > MaxTileSplit) ? MaxTileSplit : maxSplit;
+}
+
+/*! Tiles that cost much more than the average in the last pass are split in parts of about the average cost,
+ *  groups of four tiles that together cost less than the average are merged in a single unit. */
+void ThreadManager::planTileUnits(JobState &job, int pass)
+{
+	const int tileSize = job.conf.tileSize;
+	const int numColumns = job.numColumns;
+
+	for (int i = 0; i < job.numTiles; i++)
+		job.tilePlans[i] = 0;
+
+	if (pass > 0 && job.conf.adaptiveTiles)
+	{
+		// The cost of every unit is spread over the tiles it covers, in proportion to the area
+		for (int i = 0; i < job.numTiles; i++)
+			job.tileCosts[i] = 0.0f;
+
+		const int lastIndex = (pass - 1) % 2;
+		const int numLastUnits = job.numUnits[lastIndex];
+		float totalCost = 0.0f;
+		for (int i = 0; i < numLastUnits; i++)
+		{
+			const TileUnit &unit = job.units[lastIndex][i];
+			const float costPerPixel = unit.cost / static_cast<float>(unit.width * unit.height);
+			for (int row = unit.y / tileSize; row <= (unit.y + unit.height - 1) / tileSize; row++)
+			{
+				const int overlapY = std::min(unit.y + unit.height, (row + 1) * tileSize) - std::max(unit.y, row * tileSize);
+				for (int column = unit.x / tileSize; column <= (unit.x + unit.width - 1) / tileSize; column++)
+				{
+					const int overlapX = std::min(unit.x + unit.width, (column + 1) * tileSize) - std::max(unit.x, column * tileSize);
+					job.tileCosts[row * numColumns + column] += costPerPixel * overlapX * overlapY;
+				}
+			}
+			totalCost += unit.cost;
+		}
+
+		// Converged tiles have no cost, they are not part of the average
+		const int numActiveTiles = job.numTiles - job.numConvergedTiles.load();
+		const float meanCost = (numActiveTiles > 0) ? totalCost / numActiveTiles : 0.0f;
+		if (meanCost > 0.0f)
+		{
+			const int maxSplit = maxTileSplit(tileSize);
+			for (int i = 0; i < job.numTiles; i++)
+			{
+				const int split = static_cast<int>(sqrtf(job.tileCosts[i] / meanCost) + 0.5f);
+				if (split >= 2 && maxSplit >= 2)
+					job.tilePlans[i] = (split < maxSplit) ? split : maxSplit;
+			}
+
+			const float mergeCost = meanCost * 0.25f;
+			for (int row = 0; row + 1 < job.numRows; row += 2)
+			{
+				for (int column = 0; column + 1 < numColumns; column += 2)
+				{
+					const int index = row * numColumns + column;
+					const bool isActiveGroup = job.convergedSamples[index].load() == 0 && job.convergedSamples[index + 1].load() == 0 &&
+					                           job.convergedSamples[index + numColumns].load() == 0 && job.convergedSamples[index + numColumns + 1].load() == 0;
+					if (isActiveGroup && job.tileCosts[index] < mergeCost && job.tileCosts[index + 1] < mergeCost &&
+					    job.tileCosts[index + numColumns] < mergeCost && job.tileCosts[index + numColumns + 1] < mergeCost)
+					{
+						job.tilePlans[index] = MergedTile;
+						job.tilePlans[index + 1] = MergedTile;
+						job.tilePlans[index + numColumns] = MergedTile;
+						job.tilePlans[index + numColumns + 1] = MergedTile;
+					}
+				}
+			}
+		}
+	}
+
+	// Units follow the visiting order of the tiles
+	const int passIndex = pass % 2;
+	int numUnits = 0;
+	for (int i = 0; i < job.numTiles; i++)
+	{
+		const int index = job.tileOrder[i];
+		const int plan = job.tilePlans[index];
+		if (plan == EmittedTile || job.convergedSamples[index].load() > 0)
+			continue;
+
+		const int column = index % numColumns;
+		const int row = index / numColumns;
+		if (plan == MergedTile)
+		{
+			const int groupColumn = column & ~1;
+			const int groupRow = row & ~1;
+			const int groupIndex = groupRow * numColumns + groupColumn;
+			job.tilePlans[groupIndex] = EmittedTile;
+			job.tilePlans[groupIndex + 1] = EmittedTile;
+			job.tilePlans[groupIndex + numColumns] = EmittedTile;
+			job.tilePlans[groupIndex + numColumns + 1] = EmittedTile;
+
+			TileUnit &unit = job.units[passIndex][numUnits++];
+			unit.x = groupColumn * tileSize;
+			unit.y = groupRow * tileSize;
+			unit.width = std::min(2 * tileSize, job.width - unit.x);
+			unit.height = std::min(2 * tileSize, job.height - unit.y);
+			unit.cost = 0.0f;
+			unit.error = 0.0f;
+			continue;
+		}
+
+		const int startX = column * tileSize;
+		const int startY = row * tileSize;
+		const int tileSizeX = std::min(tileSize, job.width - startX);
+		const int tileSizeY = std::min(tileSize, job.height - startY);
+		const int split = (plan >= 2) ? plan : 1;
+		for (int splitY = 0; splitY < split; splitY++)
+		{
+			const int y0 = startY + (tileSizeY * splitY) / split;
+			const int y1 = startY + (tileSizeY * (splitY + 1)) / split;
+			for (int splitX = 0; splitX < split; splitX++)
+			{
+				const int x0 = startX + (tileSizeX * splitX) / split;
+				const int x1 = startX + (tileSizeX * (splitX + 1)) / split;
+				if (x1 > x0 && y1 > y0)
+				{
+					TileUnit &unit = job.units[passIndex][numUnits++];
+					unit.x = x0;
+					unit.y = y0;
+					unit.width = x1 - x0;
+					unit.height = y1 - y0;
+					unit.cost = 0.0f;
+					unit.error = 0.0f;
+				}
+			}
+		}
+	}
+	ASSERT(numUnits <= job.maxUnits);
+	job.numUnits[passIndex] = numUnits;
+}
+
+/*! \returns The number of samples per pixel of the next pass, or zero if the render has to stop */
+int ThreadManager::nextSamplesPerPass(const JobState &job)
+{
+	const int remainingSamples = job.numSamples - job.completedSamples.load();
+	if (remainingSamples <= 0)
+		return 0;
+
+	const int samplesPerPass = job.samplesPerPass.load();
+	const float secondsPerSample = job.passStartTime.secondsSince() / samplesPerPass;
+	int nextSamples = samplesPerPass;
+
+	if (job.conf.frameBudget > 0.0f && secondsPerSample > 0.0f)
+	{
+		// The number of samples can at most double from one pass to the next, to recover from timing noise
+		nextSamples = static_cast<int>(job.conf.frameBudget / secondsPerSample);
+		if (nextSamples > 2 * samplesPerPass)
+			nextSamples = 2 * samplesPerPass;
+		if (nextSamples < 1)
+			nextSamples = 1;
+	}
+
+	if (job.conf.totalBudget > 0.0f)
+	{
+		const float remainingTime = job.conf.totalBudget - job.startTime.secondsSince();
+		const int affordableSamples = (secondsPerSample > 0.0f) ? static_cast<int>(remainingTime / secondsPerSample) : remainingSamples;
+		if (affordableSamples < 1)
+			return 0;
+		if (nextSamples > affordableSamples)
+			nextSamples = affordableSamples;
+	}
+
+	return (nextSamples < remainingSamples) ? nextSamples : remainingSamples;
+}
+
+void ThreadManager::advancePass(JobState &job, PoolState &pool)
+{
+	job.completedSamples += job.samplesPerPass.load();
+	const int nextSamples = nextSamplesPerPass(job);
+
+	const int nextPass = job.pass.load() + 1;
+	if (nextSamples > 0)
+	{
+		ASSERT(nextPass < job.numPasses);
+		if (job.tileErrors)
+			updateConvergedTiles(job);
+		// Units of the next pass are planned in the other buffer, while threads might still read the current one
+		planTileUnits(job, nextPass);
+	}
+
+	// The render also ends when every tile has converged
+	if (nextSamples > 0 && job.numUnits[nextPass % 2] > 0)
+	{
+		job.samplesPerPass = nextSamples;
+		job.passStartTime = nc::TimeStamp::now();
+		job.completedTiles = 0;
+		job.completedUnitSamples = 0;
+		// Units of the pass are split among the workers of the moment, a change in their number waits for the next one
+		job.passWorkers = job.numWorkers.load();
+		// Queues are filled before publishing the pass, a thread that sees its number always finds its units
+		fillQueues(job, nextPass, job.numUnits[nextPass % 2]);
+		job.pass = nextPass;
+
+		// Threads without units in the previous pass are sleeping
+		std::unique_lock<std::mutex> lock(pool.mutex);
+		pool.passCondition.notify_all();
+	}
+	else
+	{
+		// Stopping on a whole pass leaves all the pixels of a tile with the same number of samples
+		job.renderTime = job.startTime.secondsSince();
+		job.pass = job.numPasses;
 
-		tls.progress = 1.0f / static_cast<float>(maxSamples) * (sample + iteration / static_cast<float>(numColumns * numRows));
+		// Taking the lock after publishing the pass avoids missing the wake up of a thread that is about to wait
+		std::unique_lock<std::mutex> lock(pool.mutex);
+		pool.doneCondition.notify_all();
+		pool.passCondition.notify_all();
 	}
 }
@@ -3,6 +3,7 @@
 #include "UserInterface.h"
 #include "VisualFeedback.h"
 #include "SceneContext.h"
+#include "Benchmark.h"
 #include "LuaSerializer.h"
 
 #include "Plane.h"
@@ -142,14 +143,44 @@ const char *samplerTypeToString(pm::Sampler::Type type)
 	return "Unknown";
 }
 
+/// Counts the view plane, the materials, the lights and the objects that sample from the sampler
+unsigned int numSamplerUsers(const pm::World &world, const pm::Sampler *sampler)
+{
+	unsigned int numUsers = (world.viewPlane().sampler() == sampler) ? 1 : 0;
+	for (const auto &material : world.materials())
+	{
+		if (material->type() == pm::Material::Type::MATTE || material->type() == pm::Material::Type::PHONG)
+		{
+			const pm::Matte *matte = static_cast<const pm::Matte *>(material.get());
+			numUsers += (matte->ambient().sampler() == sampler) ? 1 : 0;
+			numUsers += (matte->diffuse().sampler() == sampler) ? 1 : 0;
+		}
+		if (material->type() == pm::Material::Type::PHONG)
+			numUsers += (static_cast<const pm::Phong *>(material.get())->specular().sampler() == sampler) ? 1 : 0;
+	}
+	for (const auto &light : world.lights())
+	{
+		if (light->type() == pm::Light::Type::AMBIENT_OCCLUDER)
+			numUsers += (static_cast<const pm::AmbientOccluder *>(light.get())->sampler() == sampler) ? 1 : 0;
+		else if (light->type() == pm::Light::Type::ENVIRONMENT)
+			numUsers += (static_cast<const pm::EnvironmentLight *>(light.get())->sampler() == sampler) ? 1 : 0;
+	}
+	for (const auto &object : world.objects())
+	{
+		if (object->type() == pm::Geometry::Type::RECTANGLE)
+			numUsers += (static_cast<const pm::Rectangle *>(object.get())->sampler() == sampler) ? 1 : 0;
+	}
+	return numUsers;
+}
+
 }
 
 ///////////////////////////////////////////////////////////
 // CONSTRUCTORS and DESTRUCTOR
 ///////////////////////////////////////////////////////////
 
-UserInterface::UserInterface(VisualFeedback &vf, SceneContext &sc)
-    : auxString_(MaxStringLength), filename_(MaxStringLength), vf_(vf), sc_(sc)
+UserInterface::UserInterface(VisualFeedback &vf, SceneContext &sc, Benchmark &bm)
+    : auxString_(MaxStringLength), filename_(MaxStringLength), vf_(vf), sc_(sc), bm_(bm)
 {
 	filename_ = "world.lua";
 
@@ -184,17 +215,74 @@ void UserInterface::createGuiMainWindow()
 		ImGui::SliderFloat("Delay", &vfConf.textureCopyDelay, 0.0f, 60.0f, "%.1f");
 		ImGui::SameLine();
 		ImGui::Checkbox("Enabled", &vfConf.progressiveCopy);
+		ImGui::Checkbox("Dirty Tiles Only", &scConf.copyDirtyTiles);
+		ImGui::SameLine();
+		ImGui::Checkbox("Sample Counts", &scConf.showSampleCounts);
+		// The configuration can change outside of the widget, by a benchmark for example
+		float frameTimeTargetMs = scConf.frameTimeTarget * 1000.0f;
+		if (ImGui::SliderFloat("Frame Time Target", &frameTimeTargetMs, 0.0f, 100.0f, "%.1f ms"))
+			scConf.frameTimeTarget = frameTimeTargetMs * 0.001f;
+		if (scConf.frameTimeTarget > 0.0f)
+		{
+			ImGui::SameLine();
+			ImGui::Text("Threads: %u / %d", sc_.threadsLimit(), scConf.numThreads);
+		}
 	}
 
 	if (ImGui::CollapsingHeader("Performances"))
 	{
+		const char *backendItems[] = { "Single Thread", "Tiled Single Thread", "std::thread", "nc::Thread", "Job System" };
+		int currentBackend = static_cast<int>(scConf.backend);
+		if (ImGui::Combo("Backend", &currentBackend, backendItems, IM_ARRAYSIZE(backendItems)))
+			scConf.backend = static_cast<ThreadManager::Backend>(currentBackend);
 		ImGui::SliderInt("Tile Size", &scConf.tileSize, 4, 256);
-		ImGui::SliderInt("Num Threads", &scConf.numThreads, 1, scConf.maxThreads);
+		if (ImGui::SliderInt("Num Threads", &scConf.numThreads, 1, scConf.maxThreads))
+			sc_.updateNumThreads();
+
+		const char *schedulerItems[] = { "Static Interleave", "Shared Cursor", "Work Stealing" };
+		int currentScheduler = static_cast<int>(scConf.scheduler);
+		if (ImGui::Combo("Scheduler", &currentScheduler, schedulerItems, IM_ARRAYSIZE(schedulerItems)))
+			scConf.scheduler = static_cast<ThreadManager::Scheduler>(currentScheduler);
+		const char *tileOrderItems[] = { "Row Major", "Morton", "Hilbert", "Spiral" };
+		int currentTileOrder = static_cast<int>(scConf.tileOrder);
+		if (ImGui::Combo("Tile Order", &currentTileOrder, tileOrderItems, IM_ARRAYSIZE(tileOrderItems)))
+			scConf.tileOrder = static_cast<ThreadManager::TileOrder>(currentTileOrder);
+		ImGui::Checkbox("Tile Buffers", &scConf.tileBuffers);
+		ImGui::SameLine();
+		ImGui::Checkbox("Adaptive Tiles", &scConf.adaptiveTiles);
+		ImGui::SameLine();
+		ImGui::Text("Work Units: %d", sc_.numTileUnits());
+		const char *placementItems[] = { "Logical CPUs", "Physical Cores First", "NUMA Round-Robin" };
+		int currentPlacement = static_cast<int>(scConf.placement);
+		if (ImGui::Combo("Placement", &currentPlacement, placementItems, IM_ARRAYSIZE(placementItems)))
+			scConf.placement = static_cast<ThreadManager::Placement>(currentPlacement);
+		ImGui::Text("Pool: %u threads, Restart Latency: %.3f ms", sc_.threadPoolSize(), sc_.restartLatency() * 1000.0f);
+		ImGui::SliderInt("Niceness", &scConf.niceness, 0, 19);
+		ImGui::SameLine();
+		ImGui::Checkbox("Yield", &scConf.yieldBetweenTiles);
+		ImGui::SliderInt("Samples per Visit", &scConf.samplesPerVisit, 1, 64);
+		float frameBudgetMs = scConf.frameBudget * 1000.0f;
+		if (ImGui::SliderFloat("Frame Budget", &frameBudgetMs, 0.0f, 1000.0f, "%.0f ms"))
+			scConf.frameBudget = frameBudgetMs * 0.001f;
+		ImGui::SliderFloat("Total Budget", &scConf.totalBudget, 0.0f, 600.0f, "%.0f s");
+		ImGui::SliderFloat("Error Threshold", &scConf.errorThreshold, 0.0f, 0.1f, "%.3f");
+		if (scConf.errorThreshold > 0.0f)
+		{
+			// The variance of the pixels is only estimated in tile buffers
+			ImGui::SameLine();
+			if (scConf.tileBuffers == false)
+				ImGui::TextUnformatted("(ignored without tile buffers)");
+			else if (scConf.scheduler == ThreadManager::Scheduler::STATIC_INTERLEAVE && scConf.backend != ThreadManager::Backend::JOB_SYSTEM)
+				ImGui::TextUnformatted("(ignored by Static Interleave)");
+			else
+				ImGui::Text("Converged: %d / %d tiles", sc_.numConvergedTiles(), sc_.numTiles());
+		}
+		ImGui::Text("Samples per Pass: %d", sc_.samplesPerPass());
 
 		const char *tracerItems[] = { "RayCast", "Whitted", "AreaLighting", "PathTrace", "GlobalTrace" };
-		static int currentTracer = static_cast<int>(scConf.tracerType);
-		ImGui::Combo("Tracer Type", &currentTracer, tracerItems, IM_ARRAYSIZE(tracerItems));
-		scConf.tracerType = static_cast<pm::Tracer::Type>(currentTracer);
+		int currentTracer = static_cast<int>(scConf.tracerType);
+		if (ImGui::Combo("Tracer Type", &currentTracer, tracerItems, IM_ARRAYSIZE(tracerItems)))
+			scConf.tracerType = static_cast<pm::Tracer::Type>(currentTracer);
 	}
 
 	if (ImGui::CollapsingHeader("View Plane"))
@@ -207,6 +295,7 @@ void UserInterface::createGuiMainWindow()
 		ImGui::InputInt("Height", &height);
 		if (ImGui::Button("Apply"))
 		{
+			sc_.stopTracingAndWait();
 			viewPlane.setDimensions(width, height);
 			sc_.resizeFrame(width, height);
 			vf_.resizeTexture(width, height);
@@ -233,9 +322,9 @@ void UserInterface::createGuiMainWindow()
 	if (ImGui::CollapsingHeader("Camera"))
 	{
 		const char *cameraItems[] = { "Ortographic", "Pin Hole" };
-		static int currentCamera = static_cast<int>(scConf.camera->type());
-		ImGui::Combo("Type", &currentCamera, cameraItems, IM_ARRAYSIZE(cameraItems));
-		sc_.setCameraType(static_cast<pm::Camera::Type>(currentCamera));
+		int currentCamera = static_cast<int>(scConf.camera->type());
+		if (ImGui::Combo("Type", &currentCamera, cameraItems, IM_ARRAYSIZE(cameraItems)))
+			sc_.setCameraType(static_cast<pm::Camera::Type>(currentCamera));
 
 		ImGui::InputFloat3("Eye", scConf.camera->editEye().data());
 		ImGui::InputFloat3("Look At", scConf.camera->editLookAt().data());
@@ -275,7 +364,9 @@ void UserInterface::createGuiMainWindow()
 
 		if (ImGui::Button("Load"))
 		{
+			sc_.stopTracingAndWait();
 			LuaSerializer::load(filename_.data(), world);
+			sc_.clearReference();
 			const int width = world.viewPlane().width();
 			const int height = world.viewPlane().height();
 			sc_.resizeFrame(width, height);
@@ -287,11 +378,18 @@ void UserInterface::createGuiMainWindow()
 		ImGui::SameLine();
 		if (ImGui::Button("Clear"))
 		{
-			if (sc_.isTracing())
-				sc_.stopTracing();
+			sc_.stopTracingAndWait();
 			world.clear();
+			sc_.clearReference();
 		}
 
+		const char *builtinSceneItems[] = { "Spheres", "Cornell Box" };
+		static int currentBuiltinScene = static_cast<int>(SceneContext::BuiltinScene::CORNELL_BOX);
+		ImGui::Combo("Built-in Scene", &currentBuiltinScene, builtinSceneItems, IM_ARRAYSIZE(builtinSceneItems));
+		ImGui::SameLine();
+		if (ImGui::Button("Load##BuiltinScene"))
+			sc_.loadBuiltinScene(static_cast<SceneContext::BuiltinScene>(currentBuiltinScene));
+
 		ImGui::ColorEdit3("Background", world.editBackground().data());
 
 		std::vector<std::unique_ptr<pm::Sampler>> &samplers = world.samplers();
@@ -352,6 +450,8 @@ void UserInterface::createGuiMainWindow()
 				}
 				index++;
 			}
+			if (ImGui::Button("Add Emissive Area Lights"))
+				sc_.addEmissiveAreaLights();
 			ImGui::TreePop();
 		}
 
@@ -449,6 +549,39 @@ void UserInterface::createGuiMainWindow()
 #endif
 	}
 
+	if (ImGui::CollapsingHeader("Benchmark"))
+	{
+		Benchmark::Configuration &bmConf = bm_.config();
+		const char *benchmarkItems[] = { "Tile Order", "Tile Size", "Backend", "Thread Scaling", "Light Scaling", "Equal Time" };
+		static int currentBenchmark = static_cast<int>(bmConf.type);
+		ImGui::Combo("Type##Benchmark", &currentBenchmark, benchmarkItems, IM_ARRAYSIZE(benchmarkItems));
+		bmConf.type = static_cast<Benchmark::Type>(currentBenchmark);
+		ImGui::SliderInt("Repetitions", &bmConf.numRepetitions, 1, 10);
+
+		if (bm_.isRunning())
+		{
+			auxString_.format("%.2f%%", bm_.progress() * 100.0f);
+			ImGui::ProgressBar(bm_.progress(), ImVec2(-1.00f, 0.0f), auxString_.data());
+			if (ImGui::Button("Cancel##Benchmark"))
+				bm_.cancel();
+		}
+		else
+		{
+			ImGui::TextUnformatted("The world is replaced by the built-in scenes");
+			if (ImGui::Button("Run##Benchmark"))
+				bm_.start();
+		}
+
+		for (unsigned int i = 0; i < bm_.results().size(); i++)
+		{
+			const Benchmark::Result &result = bm_.results()[i];
+			if (result.rmse >= 0.0f)
+				ImGui::Text("%s: %.3fs, %.2f Msamples/s, x%.2f, RMSE %.5f", result.name.data(), result.seconds, result.megaSamplesPerSecond, result.speedup, result.rmse);
+			else
+				ImGui::Text("%s: %.3fs, %.2f Msamples/s, x%.2f", result.name.data(), result.seconds, result.megaSamplesPerSecond, result.speedup);
+		}
+	}
+
 	if (sc_.isTracing())
 	{
 		auxString_.format("%.2f%%", sc_.tracingProgress() * 100.0f);
@@ -463,13 +596,27 @@ void UserInterface::createGuiMainWindow()
 	if (ImGui::Button("Trace"))
 	{
 		vf_.startTimer();
-		sc_.reset();
 		sc_.stopTracing();
+		sc_.reset();
 		sc_.startTracing();
 	}
 
+	if (sc_.hasReference())
+	{
+		ImGui::SameLine();
+		ImGui::Text("RMSE: %.5f", sc_.rmse());
+	}
+
 	if (!sc_.isTracing())
 	{
+		if (ImGui::Button("Store Reference"))
+			sc_.storeReference();
+		if (sc_.hasReference())
+		{
+			ImGui::SameLine();
+			if (ImGui::Button("Clear Reference"))
+				sc_.clearReference();
+		}
 		if (ImGui::Button("Save PBM"))
 			sc_.savePbm("image.pbm", true);
 		ImGui::SameLine();
@@ -541,6 +688,11 @@ void UserInterface::createSamplerGuiTree(pm::Sampler *sampler)
 
 	ImGui::PushID(reinterpret_cast<const void *>(sampler));
 
+	// Resizing a shared sampler changes the samples of all its users
+	const unsigned int numUsers = numSamplerUsers(sc_.world(), sampler);
+	if (numUsers > 1)
+		auxString_.formatAppend(" (shared by %u)", numUsers);
+
 	if (ImGui::TreeNode(auxString_.data()))
 	{
 		int numSamples = sampler->numSamples();
@@ -551,7 +703,10 @@ void UserInterface::createSamplerGuiTree(pm::Sampler *sampler)
 				numSamples = sampler->numSamples();
 
 			if (numSamples > 0 && numSamples != sampler->numSamples())
+			{
+				sc_.stopTracingAndWait();
 				sampler->resize(numSamples);
+			}
 		}
 		ImGui::PopItemWidth();
 
@@ -608,6 +763,12 @@ bool UserInterface::createLightGuiTree(pm::Light *light)
 				ImGui::InputFloat("Radiance Scale", &ambientOccluder->editRadianceScale());
 				ImGui::ColorEdit3("Color", ambientOccluder->editColor().data());
 				ImGui::ColorEdit3("Minimum Amount", ambientOccluder->editMinAmount().data());
+				if (ambientOccluder->sampler())
+				{
+					const pm::Sampler::Type samplerType = ambientOccluder->sampler()->type();
+					auxString_.format("%s Sampler", samplerTypeToString(samplerType));
+					createSamplerGuiTree(ambientOccluder->sampler());
+				}
 				break;
 			}
 			case pm::Light::Type::AREA:
@@ -626,6 +787,12 @@ bool UserInterface::createLightGuiTree(pm::Light *light)
 				const pm::Material::Type materialType = material->type();
 				auxString_.format("%s Material", materialTypeToString(materialType));
 				createMaterialGuiTree(material);
+				if (environmentLight->sampler())
+				{
+					const pm::Sampler::Type samplerType = environmentLight->sampler()->type();
+					auxString_.format("%s Sampler", samplerTypeToString(samplerType));
+					createSamplerGuiTree(environmentLight->sampler());
+				}
 				break;
 			}
 		}
@@ -776,5 +943,7 @@ void UserInterface::onCameraChanged()
 	sc_.config().camera->computeUvw();
 	sc_.stopTracing();
 	sc_.reset();
+	// A reference of another view would make the error meaningless
+	sc_.clearReference();
 	sc_.startTracing();
 }
@@ -19,19 +19,17 @@
 #include "Rectangle.h"
 #include "EnvironmentLight.h"
 #include "Tracer.h"
+#include "SceneContext.h"
 
 #include <ncine/common_macros.h>
 
-#define CORNELL_BOX (1)
+// Spheres scene options
+#define AMBIENT (0)
+#define AMBIENT_OCCLUSION (1)
 
-#if !CORNELL_BOX
-	#define AMBIENT (0)
-	#define AMBIENT_OCCLUSION (1)
-
-	#define POINT_LIGHTS (1)
-	#define AREA_LIGHTS (0)
-	#define PATH_TRACE (0)
-#endif
+#define POINT_LIGHTS (1)
+#define AREA_LIGHTS (0)
+#define PATH_TRACE (0)
 
 namespace {
 
@@ -343,15 +341,19 @@ void validateWorld(const pm::World &world)
 
 }
 
-void initWorld(pm::World &world, pm::PinHole &camera, pm::Tracer::Type &tracerType)
+void initWorld(pm::World &world, pm::PinHole &camera, pm::Tracer::Type &tracerType, SceneContext::BuiltinScene scene)
 {
 	world.viewPlane().editPixelSize() = 0.004f;
 
-#if CORNELL_BOX
-	setupCornellBox(world, camera, tracerType);
-#else
-	setupSpheres(world, camera, tracerType);
-#endif
+	switch (scene)
+	{
+		case SceneContext::BuiltinScene::SPHERES:
+			setupSpheres(world, camera, tracerType);
+			break;
+		case SceneContext::BuiltinScene::CORNELL_BOX:
+			setupCornellBox(world, camera, tracerType);
+			break;
+	}
 	validateWorld(world);
 
 	LOGI_X("Scene statistics: %u objects, %u materials, %u lights, %u samplers",
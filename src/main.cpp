@@ -13,7 +13,9 @@
 #include "VisualFeedback.h"
 #include "UserInterface.h"
 #include "SceneContext.h"
+#include "Benchmark.h"
 
+#include <cstring>
 #include <ncine/Application.h>
 
 namespace {
@@ -21,6 +23,10 @@ namespace {
 const unsigned int imageWidth = 1280;
 const unsigned int imageHeight = 720;
 
+const char *backendNames[] = { "single", "tiled", "std", "nc", "jobs" };
+/// The backend chosen with the `--backend` command line option
+ThreadManager::Backend commandLineBackend = ThreadManager::Backend::NC_THREAD;
+
 }
 
 nctl::UniquePtr<nc::IAppEventHandler> createAppEventHandler()
@@ -44,7 +50,8 @@ void MyEventHandler::onPreInit(nc::AppConfiguration &config)
 	config.withScenegraph = false;
 	config.withAudio = false;
 	config.withDebugOverlay = false;
-	config.withJobSystem = false;
+	// Needed by the job system backend, its threads are idle otherwise
+	config.withJobSystem = true;
 	config.resizable = true;
 	config.vaoPoolSize = 1;
 
@@ -52,6 +59,19 @@ void MyEventHandler::onPreInit(nc::AppConfiguration &config)
 	config.windowIconFilename = "icon48.png";
 
 	config.consoleLogLevel = nc::ILogger::LogLevel::WARN;
+
+	for (int i = 0; i < config.argc() - 1; i++)
+	{
+		if (strcmp(config.argv(i), "--backend") != 0)
+			continue;
+
+		const char *name = config.argv(i + 1);
+		for (unsigned int j = 0; j < sizeof(backendNames) / sizeof(*backendNames); j++)
+		{
+			if (strcmp(name, backendNames[j]) == 0)
+				commandLineBackend = static_cast<ThreadManager::Backend>(j);
+		}
+	}
 }
 
 void MyEventHandler::onInit()
@@ -60,14 +80,16 @@ void MyEventHandler::onInit()
 	vf_->initTexture(imageWidth, imageHeight);
 
 	sc_ = nctl::makeUnique<SceneContext>();
+	sc_->config().backend = commandLineBackend;
 	sc_->init(imageWidth, imageHeight);
 
-	ui_ = nctl::makeUnique<UserInterface>(*vf_, *sc_);
+	bm_ = nctl::makeUnique<Benchmark>(*sc_);
+	ui_ = nctl::makeUnique<UserInterface>(*vf_, *sc_, *bm_);
 }
 
 void MyEventHandler::onShutdown()
 {
-	sc_->stopTracing();
+	sc_->stopTracingAndWait();
 }
 
 void MyEventHandler::onFrameStart()
@@ -78,6 +100,9 @@ void MyEventHandler::onFrameStart()
 		sc_->copyToTexture(vf_->texPixels());
 
 	vf_->update();
+	sc_->dispatchRenderEvents();
+	sc_->throttleThreads(nc::theApplication().interval());
+	bm_->update();
 	ui_->createGuiMainWindow();
 	ui_->cameraInteraction();
 }